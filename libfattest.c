@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include "libfatx.h"
@@ -12,25 +13,25 @@ fatx_options_t fatx_options = {
 
 void test_splitPath(const char * path)
 {
-	fatx_filename_list * list = fatx_splitPath(path);
-	fatx_filename_list *dirname, *basename;
+	fatx_path_iter iter;
+	const char * basename;
+	size_t dirLen, baseLen;
+	int err;
 	printf("full path:\n");
-	fatx_printFilenameList(list);
+	fatx_initPathIter(&iter, path, strlen(path));
+	while((err = fatx_nextPathComponent(&iter)) > 0) {
+		printf("/%.*s", (int) iter.nameLen, iter.name);
+	}
+	printf("\n");
+	if (err) {
+		printf("error = %d\n", err);
+		return;
+	}
+	fatx_splitPath(path, &dirLen, &basename, &baseLen);
 	printf("dirname:\n");
-	dirname = fatx_dirname(list);
-	fatx_printFilenameList(dirname);
+	printf("%.*s\n", (int) dirLen, path);
 	printf("basename:\n");
-	basename = fatx_basename(list);
-	fatx_printFilenameList(basename);
-	printf("origina:\n");
-	fatx_printFilenameList(list);
-
-	//for(;list != NULL; list = list->next) {
-		//printf("\tentry = %s\n", list->filename);
-	//}
-	fatx_freeFilenameList(basename);
-	fatx_freeFilenameList(dirname);
-	fatx_freeFilenameList(list);
+	printf("%.*s\n", (int) baseLen, basename ? basename : "");
 }
 
 void test_initFree(const char * path)
@@ -47,7 +48,11 @@ void test_initFree(const char * path)
 
 void test_getFatEntry(fatx_t fatx, const char * path)
 {
-	printf("Fat entry = 0x%x\n", fatx_readFatEntry(fatx, 0x400));
+	uint32_t entry;
+	if (fatx_readFatEntry(fatx, 0x400, &entry))
+		printf("Failed to read the FAT.\n");
+	else
+		printf("Fat entry = 0x%x\n", entry);
 }
 void test_listDir(fatx_t fatx, const char * path)
 {
@@ -62,6 +67,40 @@ void test_listDir(fatx_t fatx, const char * path)
 	fatx_closedir(iter);
 }
 
+void test_listDirBatch(fatx_t fatx, const char * path)
+{
+	fatx_dir_iter_t iter = fatx_opendir(fatx, path);
+	fatx_dirent_plus_t entries[32];
+	int i, n;
+	if (iter == NULL) {
+		printf("\"%s\" is not a folder.\n", path);
+		return;
+	}
+	printf("Testing batch listing directory: %s\n", path);
+	while( (n = fatx_readdir_batch(iter, entries, 32)) > 0) {
+		for(i = 0; i < n; i++) {
+			printf("\tdirentry = %s size = %u mode = %o\n", entries[i].d_name,
+			       entries[i].size, entries[i].mode);
+		}
+	}
+	fatx_closedir(iter);
+}
+
+int test_walkEntry(const char * path, const fatx_dirent_plus_t * entry, void * arg)
+{
+	printf("\t%s size = %u mode = %o\n", path, entry->size, entry->mode);
+	return 0;
+}
+
+void test_walk(fatx_t fatx, const char * path)
+{
+	int ret;
+	printf("Testing walking: %s\n", path);
+	ret = fatx_walk(fatx, path, test_walkEntry, NULL, 0);
+	if(ret)
+		printf("\tfatx_walk failed: %d\n", ret);
+}
+
 void
 test_testStat(fatx_t fatx, const char * path)
 {
@@ -99,8 +138,28 @@ test_read(fatx_t fatx, const char * path, const char * outfile)
 void
 test_findFirstFreeDirEntry(fatx_t fatx, const char * path)
 {
-	fatx_directory_entry * entry = fatx_getFirstOpenDirectoryEntry(fatx, NULL);
-	printf("first free filesize = %x", entry->filenameSz);
+	fatx_dirent_loc loc;
+	if (fatx_getFirstOpenDirectoryEntry(fatx, NULL, &loc) == 0)
+		printf("first free entry = %u:%u\n", loc.clusterNo, loc.entryNo);
+}
+
+void
+test_scan(fatx_t fatx, const char * name)
+{
+	fatx_cache_entry * cacheEntry = fatx_getCluster(fatx, 1);
+	size_t nameLen = strlen(name);
+	if (cacheEntry == NULL) {
+		printf("Failed to read the root folder.\n");
+		return;
+	}
+	printf("scan kernels = %d\n", fatx->scanIsa);
+	printf("first valid entry = %u (scalar %u)\n",
+	       fatx_scanValid(fatx, cacheEntry->dirEntries, 0),
+	       fatx_scanValidScalar(cacheEntry->dirEntries, 0));
+	printf("first candidate for %s = %u (scalar %u)\n", name,
+	       fatx_scanName(fatx, cacheEntry->dirEntries, 0, name, nameLen),
+	       fatx_scanNameScalar(cacheEntry->dirEntries, 0, name, nameLen));
+	fatx_releaseCluster(fatx, cacheEntry);
 }
 
 void
@@ -135,6 +194,132 @@ test_write(fatx_t fatx, const char * path)
 	printf("read data %s\n", buf2);
 }
 
+void
+test_sync(fatx_t fatx, const char * path)
+{
+	test_write(fatx, path);
+	printf("sync returned %d\n", fatx_sync(fatx));
+}
+
+void
+test_mkfiles(fatx_t fatx, const char * path)
+{
+	const char * names[] = { "a", "b", "c" };
+	uint32_t sizes[] = { 0, 0x4000, 0x10000 };
+	printf("mkfiles returned %d\n", fatx_mkfiles(fatx, path, names, sizes, 3));
+	test_listDir(fatx, path);
+}
+
+void
+test_fallocate(fatx_t fatx, const char * path)
+{
+	printf("fallocate returned %d\n", fatx_fallocate(fatx, path, 0x40000));
+	test_write(fatx, path);
+}
+
+void
+test_truncate(fatx_t fatx, const char * path)
+{
+	struct stat st;
+	test_write(fatx, path);
+	printf("truncate returned %d\n", fatx_truncate(fatx, path, 3));
+	fatx_stat(fatx, path, &st);
+	printf("size %lld\n", (long long) st.st_size);
+}
+
+void
+test_remove(fatx_t fatx, const char * path)
+{
+	struct stat st;
+	test_createFile(fatx, path);
+	printf("remove returned %d\n", fatx_remove(fatx, path));
+	printf("stat returned %d\n", fatx_stat(fatx, path, &st));
+}
+
+void
+test_removeGrownDir(fatx_t fatx, const char * path)
+{
+	char name[64];
+	uint32_t noFree = fatx->nFreeClusters;
+	int i;
+	// The walk caches the folder's extent map before it grows.
+	fatx_walk(fatx, "/", test_walkEntry, NULL, 2);
+	for(i = 0; i < 300; i++) {
+		snprintf(name, sizeof(name), "%s/f%d", path, i);
+		fatx_mkfile(fatx, name);
+	}
+	for(i = 0; i < 300; i++) {
+		snprintf(name, sizeof(name), "%s/f%d", path, i);
+		fatx_remove(fatx, name);
+	}
+	printf("remove returned %d\n", fatx_remove(fatx, path));
+	// The folder's clusters are all given back, including the grown one.
+	printf("free clusters %u, %u before\n", fatx->nFreeClusters, noFree);
+}
+
+void
+test_open(fatx_t fatx, const char * path)
+{
+	int ret = 0;
+	fatx_file_t file;
+	char *buf = "abc123";
+	char *buf2 = (char *) malloc(7);
+	ret = fatx_open(fatx, path, &file);
+	if(ret != 0) {
+		printf("ret = %d\n", ret);
+		return;
+	}
+	ret = fatx_pwrite(file, buf, 0, 7);
+	printf("pwrite returned %d\n", ret);
+	ret = fatx_pread(file, buf2, 0, 7);
+	printf("pread returned %d\n", ret);
+	printf("read data %s\n", buf2);
+	fatx_close(file);
+	// A handle must not write to a file that reuses its removed file's
+	// entry and clusters.
+	ret = fatx_open(fatx, path, &file);
+	if(ret != 0) {
+		printf("ret = %d\n", ret);
+		free(buf2);
+		return;
+	}
+	fatx_remove(fatx, path);
+	fatx_mkfile(fatx, path);
+	ret = fatx_pwrite(file, "OLDHANDLE", 0, 9);
+	printf("pwrite after remove returned %d\n", ret);
+	ret = fatx_read(fatx, path, buf2, 0, 7);
+	printf("read of the new file returned %d\n", ret);
+	fatx_close(file);
+	free(buf2);
+}
+
+void
+test_fflush(fatx_t fatx, const char * path)
+{
+	struct stat st;
+	fatx_file_t file;
+	int ret = fatx_open(fatx, path, &file);
+	if(ret != 0) {
+		printf("ret = %d\n", ret);
+		return;
+	}
+	fatx_stat(fatx, path, &st);
+	printf("pwrite returned %d\n", fatx_pwrite(file, "abc123", st.st_size, 6));
+	fatx_stat(fatx, path, &st);
+	printf("size before flush %lld\n", (long long) st.st_size);
+	printf("fflush returned %d\n", fatx_fflush(file));
+	fatx_stat(fatx, path, &st);
+	printf("size after flush %lld\n", (long long) st.st_size);
+	fatx_close(file);
+}
+
+void
+test_copyFile(fatx_t fatx, const char * src, const char * dst)
+{
+	printf("copy_file returned %d\n", fatx_copy_file(fatx, src, dst));
+	test_listDir(fatx, "/");
+}
+
 int
 main(int argc, char* argv[])
 {
@@ -150,12 +335,24 @@ main(int argc, char* argv[])
 	//test_initFree(argv[1]);
 	//test_getFatEntry(argv[1]);
 	//test_listDir(fatx, "/Cache");
+	//test_listDirBatch(fatx, "/Cache");
+	//test_walk(fatx, "/Content");
 	//test_testStat(fatx, "/Content/E0000211D831B603/FFFE07D1/00010000/E0000211D831B603");
 	//test_testStat(fatx, "/");
 	//test_splitPath("/a");
 	//test_findFreeCluster(fatx, 0);
 	//test_findFirstFreeDirEntry(fatx, "");
+	//test_scan(fatx, "Content");
 	test_write(fatx, "/abc");
+	//test_sync(fatx, "/abc");
+	//test_open(fatx, "/abc");
+	//test_fflush(fatx, "/abc");
+	//test_copyFile(fatx, "/abc", "/abc2");
+	//test_mkfiles(fatx, "/");
+	//test_fallocate(fatx, "/abc");
+	//test_truncate(fatx, "/abc");
+	//test_remove(fatx, "/abc");
+	//test_removeGrownDir(fatx, "/d");
 	fatx_free(fatx);
 	return 0;
 }
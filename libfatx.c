@@ -16,32 +16,117 @@ fatx_init(const char     * path,
           fatx_options_t * options)
 {  
    fatx_handle * fatx = (fatx_handle *) calloc(1, sizeof(fatx_handle));
+   uint32_t      cacheSize, i;
+   uint32_t      setsReady = 0;
+   int           locksReady = 0;
+   if(fatx == NULL)
+      return NULL;
+   fatx->dev = -1;
    if(options == NULL)
       goto error;
    memcpy(&fatx->options, options, sizeof(fatx_options_t));
    fatx->options.filePerm &= 0777; // only the file permissions are allowed here.
-   if((fatx->dev = open(path, O_RDWR)) <= 0)
+   // Round the cluster cache up to a whole number of sets.
+   cacheSize = fatx->options.cacheSize ? fatx->options.cacheSize : CACHE_SIZE;
+   fatx->cacheSets = (cacheSize + CACHE_WAYS - 1) / CACHE_WAYS;
+   fatx->cache = (fatx_cache_entry *) calloc(fatx->cacheSets * CACHE_WAYS,
+                                             sizeof(fatx_cache_entry));
+   fatx->cacheData = (char *) malloc(fatx->cacheSets * CACHE_WAYS * FAT_CLUSTER_SZ);
+   fatx->sets = (fatx_cache_set *) calloc(fatx->cacheSets, sizeof(fatx_cache_set));
+   if(fatx->cache == NULL || fatx->cacheData == NULL || fatx->sets == NULL)
       goto error;
-   if(pthread_mutexattr_init(&fatx->mutexAttr))
+   for(i = 0; i < fatx->cacheSets * CACHE_WAYS; i++) {
+      fatx->cache[i].buffer = fatx->cacheData + i * FAT_CLUSTER_SZ;
+      fatx->cache[i].data = fatx->cache[i].buffer;
+   }
+   // Count what has been initialised so the error path only destroys that.
+   for(setsReady = 0; setsReady < fatx->cacheSets; setsReady++) {
+      if(pthread_mutex_init(&fatx->sets[setsReady].lock, NULL))
+         goto error;
+      if(pthread_cond_init(&fatx->sets[setsReady].released, NULL)) {
+         pthread_mutex_destroy(&fatx->sets[setsReady].lock);
+         goto error;
+      }
+   }
+   if((fatx->dev = open(path, O_RDWR)) < 0)
+      goto error;
+   if(pthread_rwlock_init(&fatx->metaLock, NULL))
+      goto error;
+   locksReady = 1;
+   if(pthread_mutex_init(&fatx->fatLock, NULL))
+      goto error;
+   locksReady = 2;
+   if(pthread_mutex_init(&fatx->extentLock, NULL))
       goto error;
-   if(pthread_mutexattr_settype(&fatx->mutexAttr, PTHREAD_MUTEX_RECURSIVE))
+   locksReady = 3;
+   if(pthread_mutex_init(&fatx->flushLock, NULL))
       goto error;
-   if(pthread_mutex_init(&fatx->devLock, &fatx->mutexAttr)) 
+   locksReady = 4;
+   if(pthread_mutex_init(&fatx->dcacheLock, NULL))
       goto error;
+   locksReady = 5;
+   if(pthread_mutex_init(&fatx->dirIndexLock, NULL))
+      goto error;
+   locksReady = 6;
+   if(pthread_cond_init(&fatx->flushCond, NULL))
+      goto error;
+   locksReady = 7;
+   if(pthread_mutex_init(&fatx->openFilesLock, NULL))
+      goto error;
+   locksReady = 8;
    fatx->nClusters = fatx_calcClusters(fatx->dev);
    fatx->fatType = fatx->nClusters < FATX32_MIN_CLUSTERS ? FATX16 : FATX32;
+   fatx_initScan(fatx);
    fatx->dataStart = fatx_calcDataStart(fatx->fatType, fatx->nClusters);
    fatx->noFatPages = fatx_calcFatPages(fatx->dataStart);
-   // Load up the 0'th pages to intialize the caches
-   fatx_loadFatPage(fatx, 0);
+   fatx->fatSize = fatx_calcFatSize(fatx->fatType, fatx->nClusters);
+   if(fatx->options.mapImage && fatx_mapImage(fatx) == 0) {
+      // The FAT is served from the mapping.
+   } else if(fatx->options.residentFat) {
+      if(fatx_loadResidentFat(fatx))
+         goto error;
+   } else {
+      // Load up the 0'th pages to intialize the caches
+      if(fatx_loadFatPage(fatx, 0))
+         goto error;
+   }
+   if(fatx_buildFreeMap(fatx))
+      goto error;
+   fatx->dirtyThreshold = fatx->options.dirtyThreshold ? fatx->options.dirtyThreshold :
+                                                         fatx->cacheSets * CACHE_WAYS / 2;
+   fatx->dirIndexBudget = fatx->options.dirIndexBudget ? fatx->options.dirIndexBudget :
+                                                         DIR_INDEX_BUDGET;
+   if(fatx->options.flushInterval) {
+      if(pthread_create(&fatx->flusher, NULL, fatx_flusherMain, fatx))
+         goto error;
+      fatx->flusherRunning = 1;
+   }
    fatx->rootDirEntry.firstCluster = SWAP32(1);
    fatx->rootDirEntry.attributes = 0x10;
    return (fatx_t) fatx;
 
 error:
-   pthread_mutex_destroy(&fatx->devLock);
-   pthread_mutexattr_destroy(&fatx->mutexAttr);
-   if (fatx->dev) close(fatx->dev);
+   if(locksReady > 7) pthread_mutex_destroy(&fatx->openFilesLock);
+   if(locksReady > 6) pthread_cond_destroy(&fatx->flushCond);
+   if(locksReady > 5) pthread_mutex_destroy(&fatx->dirIndexLock);
+   if(locksReady > 4) pthread_mutex_destroy(&fatx->dcacheLock);
+   if(locksReady > 3) pthread_mutex_destroy(&fatx->flushLock);
+   if(locksReady > 2) pthread_mutex_destroy(&fatx->extentLock);
+   if(locksReady > 1) pthread_mutex_destroy(&fatx->fatLock);
+   if(locksReady > 0) pthread_rwlock_destroy(&fatx->metaLock);
+   for(i = 0; i < setsReady; i++) {
+      pthread_cond_destroy(&fatx->sets[i].released);
+      pthread_mutex_destroy(&fatx->sets[i].lock);
+   }
+   if (fatx->map) munmap(fatx->map, fatx->mapSize);
+   if (fatx->dev >= 0) close(fatx->dev);
+   free(fatx->sets);
+   free(fatx->cacheData);
+   free(fatx->cache);
+   free(fatx->fat);
+   free(fatx->fatDirty);
+   free(fatx->freeMap);
+   free(fatx->freeCount);
    free(fatx);
    return NULL;
 }
@@ -49,23 +134,63 @@ error:
 void
 fatx_free(fatx_t fatx)
 {
-   int i = 0;
+   uint32_t i = 0;
    if (fatx == NULL)
       return;
-   for(i = 0; i < CACHE_SIZE; i++) {
-      if(fatx->cache[i].dirty)
-         fatx_flushClusterCacheEntry(fatx, fatx->cache + i);
+   if(fatx->flusherRunning) {
+      pthread_mutex_lock(&fatx->flushLock);
+      fatx->flusherStop = 1;
+      pthread_cond_signal(&fatx->flushCond);
+      pthread_mutex_unlock(&fatx->flushLock);
+      pthread_join(fatx->flusher, NULL);
    }
-   for(i = 0; i < FAT_CACHE_SIZE; i++) {
-      if(fatx->fatCache[i].dirty)
-         fatx_flushFatCacheEntry(fatx, fatx->fatCache + i);
+   // Files left open still hold staged appends.
+   while(fatx->openFiles != NULL)
+      fatx_close(fatx->openFiles);
+   fatx_flush(fatx);
+   pthread_mutex_destroy(&fatx->openFilesLock);
+   pthread_cond_destroy(&fatx->flushCond);
+   pthread_mutex_destroy(&fatx->dirIndexLock);
+   pthread_mutex_destroy(&fatx->dcacheLock);
+   pthread_mutex_destroy(&fatx->flushLock);
+   pthread_mutex_destroy(&fatx->extentLock);
+   pthread_mutex_destroy(&fatx->fatLock);
+   pthread_rwlock_destroy(&fatx->metaLock);
+   for(i = 0; i < fatx->cacheSets; i++) {
+      pthread_cond_destroy(&fatx->sets[i].released);
+      pthread_mutex_destroy(&fatx->sets[i].lock);
    }
-   pthread_mutex_destroy(&fatx->devLock);
-   pthread_mutexattr_destroy(&fatx->mutexAttr);
+   if(fatx->map != NULL)
+      munmap(fatx->map, fatx->mapSize);
    close(fatx->dev);
+   free(fatx->sets);
+   free(fatx->cacheData);
+   free(fatx->cache);
+   free(fatx->fat);
+   free(fatx->fatDirty);
+   free(fatx->freeMap);
+   free(fatx->freeCount);
+   for(i = 0; i < EXTENT_CACHE_SIZE; i++)
+      fatx_freeExtentMap(fatx->extentCache[i]);
+   for(i = 0; i < DIR_INDEX_CACHE_SIZE; i++)
+      fatx_freeDirIndex(fatx->dirIndexes[i]);
+   for(i = 0; i < DIR_BLOOM_CACHE_SIZE; i++)
+      fatx_freeDirBloom(fatx->dirBlooms[i]);
    free(fatx);
 }
 
+int
+fatx_sync(fatx_t fatx)
+{
+   int err;
+   FATX_RDLOCK(fatx);
+   err = fatx_flush(fatx);
+   if(err == 0 && fsync(fatx->dev))
+      err = -errno;
+   FATX_UNLOCK(fatx);
+   return err;
+}
+
 void
 fatx_printInfo(fatx_t fatx)
 {
@@ -76,6 +201,11 @@ fatx_printInfo(fatx_t fatx)
    printf("\tfatType = %d\n", fatx_h->fatType);
    printf("\tdataStart = 0x%lx\n", fatx_h->dataStart);
    printf("\tnoFatPages = 0x%x\n", fatx_h->noFatPages);
+   printf("\tnFreeClusters = %u\n", fatx_h->nFreeClusters);
+   printf("\tresidentFat = %d\n", fatx_h->fat != NULL);
+   printf("\tmapped = %d\n", fatx_h->map != NULL);
+   printf("\tcacheSize = %u clusters (%u sets)\n", fatx_h->cacheSets * CACHE_WAYS,
+          fatx_h->cacheSets);
 }
 
 int
@@ -85,24 +215,24 @@ fatx_read(fatx_t      fatx,
           off_t       offset, 
           size_t      size)
 {
-   fatx_directory_entry * directoryEntry;
-   fatx_filename_list   * fnList = NULL;
+   fatx_directory_entry   directoryEntry;
+   fatx_dirent_loc        loc;
+   const char           * basename;
+   size_t                 dirLen, baseLen;
    int                    retVal = 0;
-   fnList = fatx_splitPath(path);
-   if(fnList == NULL) {
-      retVal = -ENOENT;
-      goto finish;
-   }
-   FATX_LOCK(fatx);
-   directoryEntry = fatx_findDirectoryEntry(fatx, fnList, &fatx->rootDirEntry);
-   if(directoryEntry == NULL) {
-      retVal = -ENOENT;
+   retVal = fatx_splitPath(path, &dirLen, &basename, &baseLen);
+   if(retVal)
+      return retVal;
+   if(basename == NULL)
+      return -ENOENT;
+   FATX_RDLOCK(fatx);
+   retVal = fatx_findDirectoryEntry(fatx, path, basename + baseLen - path, NULL,
+                                    &directoryEntry, &loc);
+   if(retVal)
       goto finish;
-   }
-   retVal = fatx_readFromDirectoryEntry(fatx, directoryEntry, buf, offset, size);
+   retVal = fatx_readFromDirectoryEntry(fatx, &directoryEntry, NULL, buf, offset, size);
 finish:
    FATX_UNLOCK(fatx);
-   fatx_freeFilenameList(fnList);
    return retVal;
 }
 
@@ -113,39 +243,244 @@ fatx_write(fatx_t      fatx,
            off_t       offset,
            size_t      size) 
 {
-   fatx_directory_entry * directoryEntry;
-   fatx_filename_list   * fnList = NULL;
+   fatx_directory_entry   directoryEntry;
+   fatx_dirent_loc        loc;
+   const char           * basename;
+   size_t                 dirLen, baseLen;
    int                    retVal = 0;
-   fnList = fatx_splitPath(path);
-   if(fnList == NULL) {
+   retVal = fatx_splitPath(path, &dirLen, &basename, &baseLen);
+   if(retVal)
+      return retVal;
+   if(basename == NULL) {
       // Writing into the root directory isn't possible.
-      retVal = -ENOENT;
+      return -ENOENT;
+   }
+   FATX_WRLOCK(fatx);
+   retVal = fatx_findDirectoryEntry(fatx, path, basename + baseLen - path, NULL,
+                                    &directoryEntry, &loc);
+   if(retVal)
       goto finish;
+   retVal = fatx_writeToDirectoryEntry(fatx, &directoryEntry, &loc, NULL, buf, offset, size);
+finish:
+   FATX_UNLOCK(fatx);
+   return retVal;
+}
+
+int
+fatx_fallocate(fatx_t      fatx,
+               const char* path,
+               off_t       size)
+{
+   fatx_directory_entry   directoryEntry;
+   fatx_dirent_loc        loc;
+   const char           * basename;
+   size_t                 dirLen, baseLen;
+   int                    err;
+   if(size < 0)
+      return -EINVAL;
+   // File sizes are 32 bits.
+   if(size > UINT32_MAX)
+      return -EFBIG;
+   err = fatx_splitPath(path, &dirLen, &basename, &baseLen);
+   if(err)
+      return err;
+   if(basename == NULL)
+      return -EISDIR;
+   FATX_WRLOCK(fatx);
+   err = fatx_findDirectoryEntry(fatx, path, basename + baseLen - path, NULL,
+                                 &directoryEntry, &loc);
+   if(err)
+      goto finish;
+   if(IS_FOLDER(&directoryEntry)) {
+      err = -EISDIR;
+      goto finish;
+   }
+   err = fatx_reserveClusters(fatx, SWAP32(directoryEntry.firstCluster),
+                              (size + FAT_CLUSTER_SZ - 1) / FAT_CLUSTER_SZ);
+finish:
+   FATX_UNLOCK(fatx);
+   return err;
+}
+
+
+int
+fatx_open(fatx_t        fatx,
+          const char  * path,
+          fatx_file_t * file)
+{
+   fatx_directory_entry   directoryEntry;
+   fatx_dirent_loc        loc;
+   fatx_file            * newFile = NULL;
+   const char           * basename;
+   size_t                 dirLen, baseLen;
+   int                    err;
+   *file = NULL;
+   err = fatx_splitPath(path, &dirLen, &basename, &baseLen);
+   if(err)
+      return err;
+   if(basename == NULL)
+      return -EISDIR;
+   FATX_RDLOCK(fatx);
+   err = fatx_findDirectoryEntry(fatx, path, basename + baseLen - path, NULL,
+                                 &directoryEntry, &loc);
+   if(err)
+      goto finish;
+   if(IS_FOLDER(&directoryEntry)) {
+      err = -EISDIR;
+      goto finish;
+   }
+   newFile = (fatx_file *) calloc(1, sizeof(fatx_file));
+   if(newFile == NULL || pthread_mutex_init(&newFile->lock, NULL)) {
+      free(newFile);
+      err = -ENOMEM;
+      goto finish;
+   }
+   newFile->fatx_h = fatx;
+   newFile->loc = loc;
+   newFile->writeOffset = SWAP32(directoryEntry.fileSize);
+   pthread_mutex_lock(&fatx->openFilesLock);
+   newFile->next = fatx->openFiles;
+   if(fatx->openFiles != NULL)
+      fatx->openFiles->prev = newFile;
+   fatx->openFiles = newFile;
+   pthread_mutex_unlock(&fatx->openFilesLock);
+   *file = newFile;
+finish:
+   FATX_UNLOCK(fatx);
+   return err;
+}
+
+int
+fatx_pread(fatx_file_t file,
+           char*       buf,
+           off_t       offset,
+           size_t      size)
+{
+   fatx_handle          * fatx = file->fatx_h;
+   fatx_directory_entry   directoryEntry;
+   fatx_cursor            cursor;
+   int                    retVal;
+   pthread_mutex_lock(&file->lock);
+   if(file->writeLen > 0) {
+      // Reads see what was appended through the handle.
+      FATX_WRLOCK(fatx);
+      retVal = fatx_writeStaged(file);
+      FATX_UNLOCK(fatx);
+      if(retVal) {
+         pthread_mutex_unlock(&file->lock);
+         return retVal;
+      }
    }
-   FATX_LOCK(fatx);
-   directoryEntry = fatx_findDirectoryEntry(fatx, fnList, &fatx->rootDirEntry);
-   if(directoryEntry == NULL) {
-      retVal = -ENOENT;
+   cursor = file->cursor;
+   pthread_mutex_unlock(&file->lock);
+   FATX_RDLOCK(fatx);
+   retVal = fatx_loadOpenEntry(file, &directoryEntry);
+   if(retVal)
       goto finish;
+   retVal = fatx_readFromDirectoryEntry(fatx, &directoryEntry, &cursor, buf, offset, size);
+finish:
+   FATX_UNLOCK(fatx);
+   pthread_mutex_lock(&file->lock);
+   file->cursor = cursor;
+   pthread_mutex_unlock(&file->lock);
+   return retVal;
+}
+
+int
+fatx_pwrite(fatx_file_t file,
+            const char* buf,
+            off_t       offset,
+            size_t      size)
+{
+   fatx_handle          * fatx = file->fatx_h;
+   fatx_directory_entry   directoryEntry;
+   size_t                 staged = 0;
+   int                    retVal;
+   pthread_mutex_lock(&file->lock);
+   if(size < WRITE_COMBINE_MAX && offset == file->writeOffset + file->writeLen) {
+      // Small appends are staged, and written out once they fill the
+      // cluster they are in.
+      while(staged < size) {
+         retVal = fatx_stageWrite(file, buf + staged, size - staged);
+         if(retVal < 0)
+            goto unlockFile;
+         staged += retVal;
+         if((file->writeOffset + file->writeLen) % FAT_CLUSTER_SZ == 0) {
+            FATX_WRLOCK(fatx);
+            retVal = fatx_writeStaged(file);
+            FATX_UNLOCK(fatx);
+            if(retVal)
+               goto unlockFile;
+         }
+      }
+      retVal = size;
+      goto unlockFile;
    }
-   retVal = fatx_writeToDirectoryEntry(fatx, directoryEntry, buf, offset, size);
+   FATX_WRLOCK(fatx);
+   retVal = fatx_writeStaged(file);
+   if(retVal)
+      goto finish;
+   retVal = fatx_loadOpenEntry(file, &directoryEntry);
+   if(retVal)
+      goto finish;
+   retVal = fatx_writeToDirectoryEntry(fatx, &directoryEntry, &file->loc, &file->cursor,
+                                       buf, offset, size);
+   if(retVal > 0)
+      file->writeOffset = offset + retVal;
 finish:
    FATX_UNLOCK(fatx);
-   fatx_freeFilenameList(fnList);
+unlockFile:
+   pthread_mutex_unlock(&file->lock);
    return retVal;
 }
 
+int
+fatx_fflush(fatx_file_t file)
+{
+   int err = 0;
+   pthread_mutex_lock(&file->lock);
+   if(file->writeLen > 0) {
+      FATX_WRLOCK(file->fatx_h);
+      err = fatx_writeStaged(file);
+      FATX_UNLOCK(file->fatx_h);
+   }
+   pthread_mutex_unlock(&file->lock);
+   return err;
+}
+
+void
+fatx_close(fatx_file_t file)
+{
+   if(file == NULL)
+      return;
+   fatx_fflush(file);
+   pthread_mutex_lock(&file->fatx_h->openFilesLock);
+   if(file->prev != NULL)
+      file->prev->next = file->next;
+   else
+      file->fatx_h->openFiles = file->next;
+   if(file->next != NULL)
+      file->next->prev = file->prev;
+   pthread_mutex_unlock(&file->fatx_h->openFilesLock);
+   pthread_mutex_destroy(&file->lock);
+   free(file->writeBuf);
+   free(file);
+}
 int
 fatx_stat(fatx_t       fatx, 
           const char*  path, 
           struct stat* st_buf)
 {
-   fatx_directory_entry * directoryEntry;
-   fatx_filename_list *   fnList;
+   fatx_directory_entry   directoryEntry;
+   fatx_dirent_loc        loc;
+   const char *           basename;
+   size_t                 dirLen, baseLen;
    int err = 0;
-   FATX_LOCK(fatx);
-   fnList = fatx_splitPath(path);
-   if(fnList == NULL) {
+   err = fatx_splitPath(path, &dirLen, &basename, &baseLen);
+   if(err)
+      return err;
+   FATX_RDLOCK(fatx);
+   if(basename == NULL) {
       // Root directory.
       st_buf->st_mode = S_IFDIR | fatx->options.filePerm;
       st_buf->st_nlink = 1;
@@ -153,33 +488,129 @@ fatx_stat(fatx_t       fatx,
       st_buf->st_uid = fatx->options.user;
       st_buf->st_gid = fatx->options.group;
    } else {
-      directoryEntry = fatx_findDirectoryEntry(fatx, fnList, &fatx->rootDirEntry);
-      fatx_freeFilenameList(fnList);
-      if(directoryEntry == NULL) {
-         err = -ENOENT;
+      err = fatx_findDirectoryEntry(fatx, path, basename + baseLen - path, NULL,
+                                    &directoryEntry, &loc);
+      if(err)
          goto finish;
-      }
-      st_buf->st_mode = IS_FOLDER(directoryEntry) ? S_IFDIR : S_IFREG;
+      st_buf->st_mode = IS_FOLDER(&directoryEntry) ? S_IFDIR : S_IFREG;
       st_buf->st_mode |= fatx->options.filePerm;
       st_buf->st_nlink = 1;
-      st_buf->st_size = SWAP32(directoryEntry->fileSize);
-      st_buf->st_mtime = fatx_makeTimeType(SWAP16(directoryEntry->modificationDate), 
-                                           SWAP16(directoryEntry->modificationTime));
-      st_buf->st_atime = fatx_makeTimeType(SWAP16(directoryEntry->accessDate), 
-                                           SWAP16(directoryEntry->accessTime));
+      st_buf->st_size = SWAP32(directoryEntry.fileSize);
+      st_buf->st_mtime = fatx_makeTimeType(SWAP16(directoryEntry.modificationDate), 
+                                           SWAP16(directoryEntry.modificationTime));
+      st_buf->st_atime = fatx_makeTimeType(SWAP16(directoryEntry.accessDate), 
+                                           SWAP16(directoryEntry.accessTime));
       st_buf->st_uid = fatx->options.user;
       st_buf->st_gid = fatx->options.group;
    }
 finish:
    FATX_UNLOCK(fatx);
-   return 0;
+   return err;
 }
 
 int
 fatx_remove(fatx_t      fatx, 
             const char* path)
 {
-   return 0;
+   fatx_directory_entry   folder;
+   fatx_directory_entry   directoryEntry;
+   fatx_dirent_loc        loc;
+   fatx_dir_iter          iter;
+   const char           * basename;
+   size_t                 dirLen, baseLen;
+   int                    err;
+   err = fatx_splitPath(path, &dirLen, &basename, &baseLen);
+   if(err)
+      return err;
+   if(basename == NULL) {
+      // The root directory can't be removed.
+      return -EBUSY;
+   }
+   FATX_WRLOCK(fatx);
+   // An empty dirname finds the root folder.
+   err = fatx_findDirectoryEntry(fatx, path, dirLen, NULL, &folder, &loc);
+   if(err)
+      goto finish;
+   err = fatx_findDirectoryEntry(fatx, basename, baseLen, &folder, &directoryEntry, &loc);
+   if(err)
+      goto finish;
+   if(IS_FOLDER(&directoryEntry)) {
+      fatx_initDirIter(fatx, &iter, &directoryEntry);
+      if(fatx_scanDirectory(fatx, &iter, NULL, 0) != NULL || iter.err) {
+         err = iter.err ? iter.err : -ENOTEMPTY;
+         goto finish;
+      }
+   }
+   err = fatx_deleteEntry(fatx, SWAP32(folder.firstCluster), &loc, &directoryEntry);
+finish:
+   FATX_UNLOCK(fatx);
+   return err;
+}
+
+int
+fatx_truncate(fatx_t      fatx,
+              const char* path,
+              off_t       size)
+{
+   fatx_directory_entry   directoryEntry;
+   fatx_dirent_loc        loc;
+   const char           * basename;
+   size_t                 dirLen, baseLen;
+   char                 * zeros = NULL;
+   off_t                  fileSize;
+   size_t                 len;
+   int                    err;
+   if(size < 0)
+      return -EINVAL;
+   // File sizes are 32 bits.
+   if(size > UINT32_MAX)
+      return -EFBIG;
+   err = fatx_splitPath(path, &dirLen, &basename, &baseLen);
+   if(err)
+      return err;
+   if(basename == NULL)
+      return -EISDIR;
+   FATX_WRLOCK(fatx);
+   err = fatx_findDirectoryEntry(fatx, path, basename + baseLen - path, NULL,
+                                 &directoryEntry, &loc);
+   if(err)
+      goto finish;
+   if(IS_FOLDER(&directoryEntry)) {
+      err = -EISDIR;
+      goto finish;
+   }
+   fileSize = SWAP32(directoryEntry.fileSize);
+   if(size < fileSize) {
+      err = fatx_truncateChain(fatx, SWAP32(directoryEntry.firstCluster),
+                               (size + FAT_CLUSTER_SZ - 1) / FAT_CLUSTER_SZ);
+      if(err)
+         goto finish;
+      directoryEntry.fileSize = SWAP32(size);
+      err = fatx_writeDirectoryEntry(fatx, &loc, &directoryEntry);
+      goto finish;
+   }
+   // Writes can't leave holes, so grow the file by writing zeros.
+   if(size > fileSize) {
+      zeros = (char *) calloc(1, FAT_CLUSTER_SZ);
+      if(zeros == NULL) {
+         err = -ENOMEM;
+         goto finish;
+      }
+      err = fatx_reserveClusters(fatx, SWAP32(directoryEntry.firstCluster),
+                                 (size + FAT_CLUSTER_SZ - 1) / FAT_CLUSTER_SZ);
+   }
+   while(err == 0 && fileSize < size) {
+      len = MIN(size - fileSize, FAT_CLUSTER_SZ - fileSize % FAT_CLUSTER_SZ);
+      err = fatx_writeToDirectoryEntry(fatx, &directoryEntry, &loc, NULL, zeros, fileSize, len);
+      if(err > 0) {
+         fileSize += err;
+         err = 0;
+      }
+   }
+finish:
+   free(zeros);
+   FATX_UNLOCK(fatx);
+   return err;
 }
 
 int
@@ -187,42 +618,243 @@ fatx_mkfile(fatx_t      fatx,
             const char* path)
 {
    int                  err       = 0;
-   uint32_t             newFileCluster = 0;
-   fatx_directory_entry * folder  = &fatx->rootDirEntry;
-   fatx_directory_entry * newFile = NULL;
-   fatx_filename_list * splitPath = fatx_splitPath(path);
-   fatx_filename_list * dirname   = fatx_dirname(splitPath);
-   fatx_filename_list * basename  = fatx_basename(splitPath);
-   FATX_LOCK(fatx);
-   if(dirname != NULL) {
-      // dirname isn't null so need to search for the folder
-      folder = fatx_findDirectoryEntry(fatx, dirname, &fatx->rootDirEntry);
-      if(folder == NULL) {
-         err = -ENOENT;
+   fatx_directory_entry folder;
+   fatx_dirent_loc      loc;
+   const char         * basename;
+   size_t               dirLen, baseLen;
+   err = fatx_splitPath(path, &dirLen, &basename, &baseLen);
+   if(err)
+      return err;
+   FATX_WRLOCK(fatx);
+   if(basename == NULL) {
+      // The root directory always exists.
+      err = -EEXIST;
+      goto finish;
+   }
+   // An empty dirname finds the root folder.
+   err = fatx_findDirectoryEntry(fatx, path, dirLen, NULL, &folder, &loc);
+   if(err)
+      goto finish;
+   err = fatx_mkFileInDirectory(fatx, &folder, basename, baseLen, NULL);
+finish:
+   FATX_UNLOCK(fatx);
+   return err;
+}
+
+int
+fatx_copy_file(fatx_t      fatx,
+               const char* src,
+               const char* dst)
+{
+   fatx_directory_entry   folder;
+   fatx_directory_entry   srcEntry;
+   fatx_directory_entry   dstEntry;
+   fatx_dirent_loc        loc;
+   const char           * basename;
+   size_t                 dirLen, baseLen;
+   uint32_t               noClusters;
+   int                    created = 0;
+   int                    err;
+   err = fatx_splitPath(src, &dirLen, &basename, &baseLen);
+   if(err)
+      return err;
+   if(basename == NULL)
+      return -EISDIR;
+   FATX_WRLOCK(fatx);
+   err = fatx_findDirectoryEntry(fatx, src, basename + baseLen - src, NULL, &srcEntry, &loc);
+   if(err)
+      goto finish;
+   if(IS_FOLDER(&srcEntry)) {
+      err = -EISDIR;
+      goto finish;
+   }
+   err = fatx_splitPath(dst, &dirLen, &basename, &baseLen);
+   if(err)
+      goto finish;
+   if(basename == NULL) {
+      err = -EEXIST;
+      goto finish;
+   }
+   err = fatx_findDirectoryEntry(fatx, dst, dirLen, NULL, &folder, &loc);
+   if(err)
+      goto finish;
+   err = fatx_mkFileInDirectory(fatx, &folder, basename, baseLen, &loc);
+   if(err)
+      goto finish;
+   err = fatx_loadDirectoryEntry(fatx, &loc, &dstEntry);
+   if(err)
+      goto finish;
+   created = 1;
+   // Reserve the whole chain first, so it comes out in as few runs as the
+   // free space allows.
+   noClusters = (SWAP32(srcEntry.fileSize) + FAT_CLUSTER_SZ - 1) / FAT_CLUSTER_SZ;
+   err = fatx_reserveClusters(fatx, SWAP32(dstEntry.firstCluster), noClusters);
+   if(err)
+      goto finish;
+   err = fatx_copyChain(fatx, SWAP32(srcEntry.firstCluster), SWAP32(dstEntry.firstCluster),
+                        noClusters);
+   if(err)
+      goto finish;
+   // The copy keeps the source's size, attributes and times.
+   srcEntry.filenameSz = dstEntry.filenameSz;
+   memcpy(srcEntry.filename, dstEntry.filename, sizeof(srcEntry.filename));
+   srcEntry.firstCluster = dstEntry.firstCluster;
+   err = fatx_writeDirectoryEntry(fatx, &loc, &srcEntry);
+finish:
+   // A failed copy leaves no partial destination behind.
+   if(err && created)
+      fatx_deleteEntry(fatx, SWAP32(folder.firstCluster), &loc, &dstEntry);
+   FATX_UNLOCK(fatx);
+   return err;
+}
+
+int
+fatx_mkfiles(fatx_t             fatx,
+             const char*        dir,
+             const char* const* names,
+             const uint32_t*    sizes,
+             size_t             count)
+{
+   int                  err = 0;
+   fatx_directory_entry folder;
+   fatx_directory_entry newFile;
+   fatx_dirent_loc      loc;
+   fatx_dirent_loc    * locs = NULL;
+   uint32_t           * firstClusters = NULL;
+   uint32_t           * seen = NULL;
+   uint32_t             noSeen, hash, nameLen, noClusters, total = 0;
+   uint32_t             noReserved = 0, runCluster, i, j;
+   if(count == 0)
+      return 0;
+   // Open addressed set of the names checked so far, to catch repeats.
+   for(noSeen = 64; noSeen < count * 2; noSeen *= 2);
+   seen = (uint32_t *) calloc(noSeen, sizeof(uint32_t));
+   firstClusters = (uint32_t *) calloc(count, sizeof(uint32_t));
+   locs = (fatx_dirent_loc *) calloc(count, sizeof(fatx_dirent_loc));
+   if(seen == NULL || firstClusters == NULL || locs == NULL) {
+      free(seen);
+      free(firstClusters);
+      free(locs);
+      return -ENOMEM;
+   }
+   FATX_WRLOCK(fatx);
+   err = fatx_findDirectoryEntry(fatx, dir, dir ? strlen(dir) : 0, NULL, &folder, &loc);
+   if(err)
+      goto finish;
+   if(!IS_FOLDER(&folder)) {
+      err = -ENOTDIR;
+      goto finish;
+   }
+   for(i = 0; i < count; i++) {
+      nameLen = strlen(names[i]);
+      if(nameLen == 0 || memchr(names[i], '/', nameLen) != NULL) {
+         err = -EINVAL;
+         goto finish;
+      }
+      if(nameLen > FATX_MAX_NAME_LEN) {
+         err = -ENAMETOOLONG;
+         goto finish;
+      }
+      hash = fatx_hashName(names[i], nameLen);
+      for(j = hash & (noSeen - 1); seen[j]; j = (j + 1) & (noSeen - 1)) {
+         if(!strcmp(names[seen[j] - 1], names[i])) {
+            err = -EEXIST;
+            goto finish;
+         }
+      }
+      seen[j] = i + 1;
+      err = fatx_findDirectoryEntry(fatx, names[i], nameLen, &folder, &newFile, &loc);
+      if(err != -ENOENT) {
+         if(err == 0)
+            err = -EEXIST;
+         goto finish;
+      }
+      err = 0;
+      noClusters = sizes ? (sizes[i] + FAT_CLUSTER_SZ - 1) / FAT_CLUSTER_SZ : 0;
+      total += MAX(noClusters, 1);
+      // Checked as it goes, so the sum of many large files can't wrap.
+      if(total > fatx->nFreeClusters) {
+         err = -ENOSPC;
          goto finish;
       }
    }
-   if (fatx_findDirectoryEntry(fatx, basename, folder) != NULL) {
-      // See if the file already exists.
-      err = -ENOENT;
+   // Take the directory slots first, as growing the directory needs
+   // clusters too. The entries get their first clusters once the files'
+   // clusters are allocated.
+   for(noReserved = 0; noReserved < count; noReserved++) {
+      err = fatx_getFirstOpenDirectoryEntry(fatx, &folder, locs + noReserved);
+      if(err)
+         goto finish;
+      nameLen = strlen(names[noReserved]);
+      memset(&newFile, 0, sizeof(fatx_directory_entry));
+      newFile.filenameSz = nameLen;
+      memcpy(newFile.filename, names[noReserved], nameLen);
+      err = fatx_writeDirectoryEntry(fatx, locs + noReserved, &newFile);
+      if(err)
+         goto finish;
+      fatx_dirIndexInsert(fatx, SWAP32(folder.firstCluster), newFile.filename, nameLen,
+                          locs + noReserved);
+   }
+   // Growing the directory may have taken some of the free clusters.
+   if(total > fatx->nFreeClusters) {
+      err = -ENOSPC;
       goto finish;
    }
-   newFile = fatx_getFirstOpenDirectoryEntry(fatx, folder);
-   newFileCluster = fatx_findFreeCluster(fatx, SWAP32(folder->firstCluster));
-   memset(newFile, 0, sizeof(fatx_directory_entry));
-   newFile->filenameSz = strlen(basename->filename);
-   memcpy(newFile->filename, basename->filename, 42);
-   newFile->firstCluster = SWAP32(newFileCluster);
-   fatx_writeFatEntry(fatx, newFileCluster, 
-                      fatx->fatType == FATX32 ? SWAP32(0xFFFFFFF8) : SWAP16(0xFFF8));
+   // One run for all of the files if there is room for it, else a chain
+   // per file.
+   runCluster = fatx_findFreeRun(fatx, SWAP32(folder.firstCluster), total);
+   for(i = 0; i < count; i++) {
+      noClusters = sizes ? (sizes[i] + FAT_CLUSTER_SZ - 1) / FAT_CLUSTER_SZ : 0;
+      noClusters = MAX(noClusters, 1);
+      if(runCluster != 0) {
+         err = fatx_writeFatRun(fatx, runCluster, noClusters, FATX_EOC(fatx));
+         if(err)
+            goto finish;
+         firstClusters[i] = runCluster;
+         runCluster += noClusters;
+      } else {
+         err = fatx_allocClusters(fatx, SWAP32(folder.firstCluster), noClusters,
+                                  firstClusters + i);
+         if(err)
+            goto finish;
+      }
+      fatx_invalidateExtentMap(fatx, firstClusters[i]);
+   }
+   for(i = 0; i < count; i++) {
+      err = fatx_loadDirectoryEntry(fatx, locs + i, &newFile);
+      if(err)
+         goto finish;
+      newFile.firstCluster = SWAP32(firstClusters[i]);
+      err = fatx_writeDirectoryEntry(fatx, locs + i, &newFile);
+      if(err)
+         goto finish;
+      fatx_dcacheInsert(fatx, SWAP32(folder.firstCluster), newFile.filename,
+                        newFile.filenameSz, locs + i);
+   }
+   memset(firstClusters, 0, count * sizeof(uint32_t));
 finish:
+   if(err) {
+      // Nothing is created when a call fails; give the slots back.
+      for(i = 0; i < noReserved; i++) {
+         if(fatx_loadDirectoryEntry(fatx, locs + i, &newFile))
+            continue;
+         newFile.filenameSz = DELETED_ENTRY;
+         fatx_writeDirectoryEntry(fatx, locs + i, &newFile);
+         fatx_dirIndexRemove(fatx, SWAP32(folder.firstCluster), names[i], strlen(names[i]),
+                             locs + i);
+      }
+   }
+   // Give back the clusters of files that weren't created.
+   for(i = 0; i < count; i++) {
+      if(firstClusters[i] != 0)
+         fatx_freeChain(fatx, firstClusters[i]);
+   }
    FATX_UNLOCK(fatx);
-   fatx_freeFilenameList(splitPath);
-   fatx_freeFilenameList(dirname);
-   fatx_freeFilenameList(basename);
+   free(seen);
+   free(firstClusters);
+   free(locs);
    return err;
 }
-
 int
 fatx_mkdir(fatx_t      fatx, 
            const char* path)
@@ -235,19 +867,13 @@ fatx_opendir(fatx_t      fatx,
              const char* path)
 {
    fatx_dir_iter *        dirIter = NULL;
-   fatx_directory_entry * directoryEntry = NULL;
-   fatx_filename_list *   fnList = NULL;
-   FATX_LOCK(fatx);
-   fnList = fatx_splitPath(path);
-   if(fnList == NULL) {
-      dirIter = fatx_createDirIter(fatx, NULL);
-      goto finish;
-   }
-   directoryEntry = fatx_findDirectoryEntry(fatx, fnList, directoryEntry);
-   if (directoryEntry == NULL) goto finish;
-   dirIter = fatx_createDirIter(fatx, directoryEntry);
-   fatx_freeFilenameList(fnList);
-finish:
+   fatx_directory_entry   directoryEntry;
+   fatx_dirent_loc        loc;
+   FATX_RDLOCK(fatx);
+   // A NULL or empty path finds the root folder.
+   if (fatx_findDirectoryEntry(fatx, path, path ? strlen(path) : 0, NULL,
+                               &directoryEntry, &loc) == 0)
+      dirIter = fatx_createDirIter(fatx, &directoryEntry);
    FATX_UNLOCK(fatx);
    return (fatx_dir_iter_t) dirIter;
 }
@@ -259,13 +885,10 @@ fatx_readdir(fatx_dir_iter_t iter)
    fatx_directory_entry * directoryEntry = NULL;
    fatx_dirent_list *     direntList = NULL;
    if (iter == NULL) return NULL;
-   FATX_LOCK(iter->fatx_h);
-   directoryEntry = fatx_readDirectoryEntry(iter->fatx_h, iter);
+   FATX_RDLOCK(iter->fatx_h);
+   // Skip over deleted entries.
+   directoryEntry = fatx_scanDirectory(iter->fatx_h, iter, NULL, 0);
    if(directoryEntry == NULL) goto finish;
-   if(!IS_VALID_ENTRY(directoryEntry)) {
-      dirent = fatx_readdir(iter);
-      goto finish;
-   }
    dirent = (fatx_dirent_t *) malloc(sizeof(fatx_dirent_t));
    dirent->d_namelen = directoryEntry->filenameSz;
    dirent->d_name = (char *) malloc(dirent->d_namelen + 1);
@@ -274,11 +897,137 @@ fatx_readdir(fatx_dir_iter_t iter)
    direntList = (fatx_dirent_list *) malloc(sizeof(fatx_dirent_list));
    direntList->dirEnt = dirent;
    direntList->next = iter->dirEntList;
+   iter->dirEntList = direntList;
 finish:
    FATX_UNLOCK(iter->fatx_h);
    return dirent;
 }
 
+int
+fatx_readdir_batch(fatx_dir_iter_t      iter,
+                   fatx_dirent_plus_t * entries,
+                   size_t               count)
+{
+   fatx_directory_entry * directoryEntry = NULL;
+   size_t                 n = 0;
+   if (iter == NULL) return -EINVAL;
+   FATX_RDLOCK(iter->fatx_h);
+   // A failed read is retried from the same place by the next call.
+   iter->err = 0;
+   while(n < count && (directoryEntry = fatx_scanDirectory(iter->fatx_h, iter, NULL, 0)))
+      fatx_fillDirentPlus(iter->fatx_h, directoryEntry, entries + n++);
+   FATX_UNLOCK(iter->fatx_h);
+   return n == 0 && iter->err ? iter->err : (int) n;
+}
+
+int
+fatx_walk(fatx_t         fatx,
+          const char*    root,
+          fatx_walk_cb_t callback,
+          void*          arg,
+          unsigned int   nthreads)
+{
+   fatx_walk_state        walk;
+   fatx_walker          * walkers = NULL;
+   pthread_t            * threads = NULL;
+   fatx_directory_entry   directoryEntry;
+   fatx_dirent_loc        loc;
+   fatx_walk_queue      * queue;
+   size_t                 rootLen = root ? strlen(root) : 0;
+   char                 * path;
+   long                   noCpus;
+   uint32_t               i, noLocks = 0, noStarted = 1;
+   int                    err;
+   if(callback == NULL)
+      return -EINVAL;
+   while(rootLen > 0 && root[rootLen - 1] == '/')
+      rootLen--;
+   FATX_RDLOCK(fatx);
+   err = fatx_findDirectoryEntry(fatx, root, rootLen, NULL, &directoryEntry, &loc);
+   if(err == 0 && !IS_FOLDER(&directoryEntry))
+      err = -ENOTDIR;
+   FATX_UNLOCK(fatx);
+   if(err)
+      return err;
+   if(nthreads == 0) {
+      noCpus = sysconf(_SC_NPROCESSORS_ONLN);
+      nthreads = noCpus > 0 ? noCpus : 1;
+   }
+   nthreads = MIN(nthreads, WALK_MAX_THREADS);
+   memset(&walk, 0, sizeof(fatx_walk_state));
+   walk.fatx_h = fatx;
+   walk.callback = callback;
+   walk.arg = arg;
+   walk.noThreads = nthreads;
+   walk.queues = (fatx_walk_queue *) calloc(nthreads, sizeof(fatx_walk_queue));
+   walkers = (fatx_walker *) malloc(nthreads * sizeof(fatx_walker));
+   threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+   if(walk.queues == NULL || walkers == NULL || threads == NULL) {
+      err = -ENOMEM;
+      goto finish;
+   }
+   for(; noLocks < nthreads; noLocks++) {
+      err = -pthread_mutex_init(&walk.queues[noLocks].lock, NULL);
+      if(err)
+         goto finish;
+   }
+   err = -pthread_mutex_init(&walk.lock, NULL);
+   if(err)
+      goto finish;
+   err = -pthread_cond_init(&walk.changed, NULL);
+   if(err) {
+      pthread_mutex_destroy(&walk.lock);
+      goto finish;
+   }
+   path = (char *) malloc(rootLen + 1);
+   if(path == NULL) {
+      err = -ENOMEM;
+   } else {
+      if(rootLen > 0)
+         memcpy(path, root, rootLen);
+      path[rootLen] = '\0';
+      err = fatx_walkPush(&walk, 0, path, &directoryEntry);
+      if(err)
+         free(path);
+   }
+   if(err == 0) {
+      // The calling thread is the first walker.
+      for(i = 0; i < nthreads; i++) {
+         walkers[i].walk = &walk;
+         walkers[i].id = i;
+      }
+      for(; noStarted < nthreads; noStarted++) {
+         err = -pthread_create(threads + noStarted, NULL, fatx_walkerMain,
+                               walkers + noStarted);
+         if(err) {
+            // Stops the walkers already started.
+            fatx_walkStop(&walk, err);
+            break;
+         }
+      }
+      fatx_walkerMain(walkers);
+      for(i = 1; i < noStarted; i++)
+         pthread_join(threads[i], NULL);
+      err = walk.result;
+   }
+   // A stopped walk leaves directories queued.
+   for(i = 0; i < nthreads; i++) {
+      queue = walk.queues + i;
+      for(; queue->head < queue->tail; queue->head++)
+         free(queue->items[queue->head].path);
+      free(queue->items);
+   }
+   pthread_cond_destroy(&walk.changed);
+   pthread_mutex_destroy(&walk.lock);
+finish:
+   for(i = 0; i < noLocks; i++)
+      pthread_mutex_destroy(&walk.queues[i].lock);
+   free(walk.queues);
+   free(walkers);
+   free(threads);
+   return err;
+}
+
 void 
 fatx_closedir(fatx_dir_iter_t iter)
 {
@@ -23,6 +23,21 @@ typedef struct fatx_dirent {
   unsigned short int d_namelen; /**< length of the name */
 } fatx_dirent_t;
 
+/**
+ * Directory entry with its attributes, filled in by fatx_readdir_batch().
+ */
+typedef struct fatx_dirent_plus {
+  char d_name[43]; /**< NUL terminated direntry name */
+  unsigned short int d_namelen; /**< length of the name */
+  mode_t mode; /**< file type and permissions, as fatx_stat() reports them */
+  uint8_t attributes; /**< FAT attributes */
+  uint32_t size; /**< file size */
+  uint32_t firstCluster; /**< first cluster of the file */
+  time_t mtime; /**< modification time */
+  time_t atime; /**< last access time */
+  time_t ctime; /**< creation time */
+} fatx_dirent_plus_t;
+
 /** Structure to store mount options */
 typedef struct fatx_options {
    /** User to own the files */
@@ -33,6 +48,22 @@ typedef struct fatx_options {
    uint32_t filePerm;
    /** Mount mode */
    uint32_t mode;
+   /** Number of clusters kept in the cluster cache, 0 for the default */
+   uint32_t cacheSize;
+   /** Keep the whole FAT in memory instead of paging it through a cache */
+   char     residentFat;
+   /** Map image files into memory and serve the FAT and clusters straight
+       from the mapping; ignored for block devices */
+   char     mapImage;
+   /** Seconds dirty data may stay in memory before the background flusher
+       writes it out; 0 disables the background flusher */
+   uint32_t flushInterval;
+   /** Number of dirty clusters that wakes the background flusher early,
+       0 for half of the cluster cache */
+   uint32_t dirtyThreshold;
+   /** Bytes of memory the directory name indexes may use, 0 for the
+       default */
+   uint32_t dirIndexBudget;
 } fatx_options_t;
 
 /**
@@ -46,12 +77,22 @@ typedef struct fatx_options {
 fatx_t fatx_init(const char* path, fatx_options_t * options);
 
 /**
- * Frees a fatx object.
+ * Frees a fatx object. Files still open are closed, writing out their
+ * staged appends, and their handles can't be used afterwards.
  *
  * \param fatx The fatx object to be freed.
  */
 void fatx_free(fatx_t fatx);
 
+/**
+ * Write all dirty clusters and FAT pages out to the device.
+ *
+ * \param fatx The fatx object.
+ * \return Error code; -EIO if anything couldn't be written. It is kept and
+ *         tried again by the next sync.
+ */
+int fatx_sync(fatx_t fatx);
+
 /**
  * Print stats about a fatx_t object.
  *
@@ -83,6 +124,82 @@ int fatx_read(fatx_t fatx, const char* path, char* buf, off_t offset, size_t siz
  */
 int fatx_write(fatx_t fatx, const char* path, const char* buf, off_t offset, size_t size);
 
+/**
+ * Reserve space for a file. Clusters are added to the file's chain until it
+ * can hold size bytes, in one contiguous run when the device has room for
+ * it. The file size is left alone; writes up to size then fill the
+ * reserved clusters instead of allocating.
+ *
+ * \param fatx The fatx object
+ * \param path The path to the file.
+ * \param size Number of bytes to reserve space for.
+ * \return Error code
+ */
+int fatx_fallocate(fatx_t fatx, const char* path, off_t size);
+
+/**
+ * Open file opaque object. It remembers where the file's directory entry
+ * is and where in the cluster chain the last call left off, so repeated
+ * and sequential I/O through it skips the path lookup and chain walk.
+ * Small appends through it are staged and written out a cluster at a time.
+ */
+typedef struct fatx_file * fatx_file_t;
+
+/**
+ * Opens a file. The handle should be freed with fatx_close() when no
+ * longer needed.
+ *
+ * \param fatx The fatx object
+ * \param path Path to the file to open.
+ * \param file Set to the open file.
+ * \return Error code
+ */
+int fatx_open(fatx_t fatx, const char* path, fatx_file_t * file);
+
+/**
+ * Read bytes from an open file.
+ *
+ * \param file The open file.
+ * \param buf Buffer to write read file data into.
+ * \param offset Offset from the beginning of the file to start reading
+ * \param size Number of bytes to read
+ * \return The number of bytes read or an error.
+ */
+int fatx_pread(fatx_file_t file, char* buf, off_t offset, size_t size);
+
+/**
+ * Write bytes into an open file. Writes smaller than a page that continue
+ * where the last one through the handle ended are staged in the handle,
+ * and only reach the file, and its size, once the cluster they are in
+ * fills up or on fatx_fflush(), fatx_pread() or fatx_close(). Errors
+ * writing staged data are returned by the call that wrote it.
+ *
+ * \param file The open file.
+ * \param buf Buffer to read data from.
+ * \param offset Offset in the file to write to.
+ * \param size Number of bytes to write into the file.
+ * \return The number of bytes written or an error
+ */
+int fatx_pwrite(fatx_file_t file, const char* buf, off_t offset, size_t size);
+
+/**
+ * Write out appends staged in an open file. Use fatx_sync() to get them
+ * onto the device.
+ *
+ * \param file The open file.
+ * \return Error code
+ */
+int fatx_fflush(fatx_file_t file);
+
+/**
+ * Closes an open file, writing out staged appends. Appends that can't be
+ * written are discarded; call fatx_fflush() first to find out whether
+ * that worked.
+ *
+ * \param file The file to close.
+ */
+void fatx_close(fatx_file_t file);
+
 /**
  * Stat a file.
  *
@@ -94,14 +211,25 @@ int fatx_write(fatx_t fatx, const char* path, const char* buf, off_t offset, siz
 int fatx_stat(fatx_t fatx, const char* path, struct stat *st_buf);
 
 /**
- * Remove a file
+ * Remove a file or an empty directory, freeing its clusters.
  *
  * \param fatx The fatx object.
  * \param path The path to the file to remove.
- * \return Error code
+ * \return Error code; -ENOTEMPTY if the directory has entries.
  */
 int fatx_remove(fatx_t fatx, const char* path);
 
+/**
+ * Change the size of a file. Shrinking frees the clusters past the new
+ * size; growing fills the new bytes with zeros.
+ *
+ * \param fatx The fatx object.
+ * \param path The path to the file.
+ * \param size The new size of the file.
+ * \return Error code
+ */
+int fatx_truncate(fatx_t fatx, const char* path, off_t size);
+
 /**
  * Create a file
  *
@@ -111,6 +239,37 @@ int fatx_remove(fatx_t fatx, const char* path);
  */
 int fatx_mkfile(fatx_t fatx, const char* path);
 
+/**
+ * Create many files in one directory. All names are checked before
+ * anything is created, nothing is created if the call fails, and the
+ * files' clusters come from one contiguous allocation when the device has
+ * room for it.
+ *
+ * \param fatx The fatx objects.
+ * \param dir Path to the directory to create the files in.
+ * \param names Names of the files to create.
+ * \param sizes Bytes to preallocate for each file, or NULL. Preallocated
+ *              clusters are chained to the file but its size stays 0.
+ * \param count Number of files to create.
+ * \return Error code; -EEXIST if a name exists or is repeated; -ENOSPC if the
+ *         files don't fit.
+ */
+int fatx_mkfiles(fatx_t fatx, const char* dir, const char* const* names,
+                 const uint32_t* sizes, size_t count);
+
+/**
+ * Copy a file within the volume. The copy's clusters are allocated up
+ * front and filled a run at a time, inside the kernel where it supports
+ * copy_file_range(). The copy gets the source's attributes and times.
+ *
+ * \param fatx The fatx object.
+ * \param src Path to the file to copy.
+ * \param dst Path of the copy, which must not exist yet.
+ * \return Error code; -EEXIST if dst exists. A failed copy leaves no
+ *         destination behind.
+ */
+int fatx_copy_file(fatx_t fatx, const char* src, const char* dst);
+
 /**
  * Create a directory
  *
@@ -146,6 +305,46 @@ fatx_dir_iter_t fatx_opendir(fatx_t fatx, const char* path);
  */
 fatx_dirent_t * fatx_readdir(fatx_dir_iter_t iter); 
 
+/**
+ * Reads many directory entries with their attributes from the given
+ * directory iterator in one call, without allocating.
+ *
+ * \param iter The iterator to get the directory entries from.
+ * \param entries Buffer to fill with directory entries.
+ * \param count Number of entries the buffer holds.
+ * \return The number of entries read; 0 if none left; an error code.
+ */
+int fatx_readdir_batch(fatx_dir_iter_t iter, fatx_dirent_plus_t * entries, size_t count);
+
+/**
+ * Callback for fatx_walk(), called once for every entry below the root.
+ * Calls may come from several threads at once, but an entry is always
+ * delivered before anything inside it.
+ *
+ * \param path Path of the entry.
+ * \param entry The entry and its attributes.
+ * \param arg The argument given to fatx_walk().
+ * \return 0 to keep walking; anything else stops the walk.
+ */
+typedef int (*fatx_walk_cb_t)(const char* path, const fatx_dirent_plus_t* entry, void* arg);
+
+/**
+ * Walks the tree below a directory with a pool of threads. Each thread
+ * keeps its own queue of directories to walk and steals from the others
+ * once its queue runs dry.
+ *
+ * \param fatx The fatx object
+ * \param root Path of the directory to walk.
+ * \param callback Called for every entry below the root.
+ * \param arg Passed to the callback.
+ * \param nthreads Number of threads to walk with, counting the caller; 0 for
+ *                 one per online CPU. At most 256 are used.
+ * \return 0 once everything was walked; the callback's return value if it
+ *         stopped the walk; an error code.
+ */
+int fatx_walk(fatx_t fatx, const char* root, fatx_walk_cb_t callback, void* arg,
+              unsigned int nthreads);
+
 /**
  * Closes the iterator and frees up any associated structures.
  * 
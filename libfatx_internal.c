@@ -2,11 +2,17 @@
  * \file libfatxutils.c
  * \author Tim Wu
  */
+#if defined(__linux__)
+// For copy_file_range.
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/disk.h>
 #include <sys/types.h>
 #include <syslog.h>
@@ -44,12 +50,18 @@ fatx_calcClusters(int dev)
    return totalClusters;
 }
  
+size_t
+fatx_calcFatSize(int fatType, uint32_t clusters)
+{
+   size_t fatSize = (size_t) clusters << fatType;
+   fatSize += fatSize & (FAT_PAGE_SZ - 1) ? FAT_PAGE_SZ : 0;
+   return fatSize & (~(FAT_PAGE_SZ - 1));
+}
+
 off_t
 fatx_calcDataStart(int fatType, uint32_t clusters)
 {
-   size_t fatSize = clusters << fatType;
-   fatSize += fatSize & (FAT_PAGE_SZ - 1) ? FAT_PAGE_SZ : 0;
-   fatSize = fatSize & (~(FAT_PAGE_SZ - 1));
+   size_t fatSize = fatx_calcFatSize(fatType, clusters);
    // For some reason the first page after the FAT counts as page 1.
    // So we'll just be skipping it
    return FAT_OFFSET + fatSize - FAT_CLUSTER_SZ;   
@@ -61,62 +73,558 @@ fatx_calcFatPages(off_t dataStart)
    return (dataStart - FAT_OFFSET) / FAT_PAGE_SZ;
 }
 
-uint32_t
+int
 fatx_readFatEntry(fatx_handle * fatx_h, 
-                  uint32_t      clusterNo)
+                  uint32_t      clusterNo,
+                  uint32_t    * entry)
 {
-   uint32_t pageNo, entryNo, entry;
+   uint32_t pageNo, entryNo;
    fatx_fat_cache_entry * cacheEntry;
-   FATX_LOCK(fatx_h);
+   // Resident FAT entries are already in host order, and are only modified
+   // under the exclusive metadata lock.
+   if (fatx_h->fat != NULL) {
+      *entry = fatx_h->fat[clusterNo];
+      return 0;
+   }
+   if (fatx_h->map != NULL) {
+      if (fatx_h->fatType == FATX32)
+         *entry = SWAP32(((uint32_t *) (fatx_h->map + FAT_OFFSET))[clusterNo]);
+      else
+         *entry = SWAP16(((uint16_t *) (fatx_h->map + FAT_OFFSET))[clusterNo]);
+      return 0;
+   }
+   pthread_mutex_lock(&fatx_h->fatLock);
    if (fatx_h->fatType == FATX32) {
       pageNo = clusterNo / FATX32_ENTRIES_PER_PAGE;
       entryNo = clusterNo & (FATX32_ENTRIES_PER_PAGE - 1);
       cacheEntry = fatx_getFatPage(fatx_h, pageNo);
-      entry = SWAP32(cacheEntry->fatx32Entries[entryNo]);
+      if (cacheEntry != NULL)
+         *entry = SWAP32(cacheEntry->fatx32Entries[entryNo]);
    } else {
       pageNo = clusterNo / FATX16_ENTRIES_PER_PAGE;
       entryNo = clusterNo & (FATX16_ENTRIES_PER_PAGE - 1);
       cacheEntry = fatx_getFatPage(fatx_h, pageNo);
-      entry = SWAP16(cacheEntry->fatx16Entries[entryNo]);
+      if (cacheEntry != NULL)
+         *entry = SWAP16(cacheEntry->fatx16Entries[entryNo]);
    }
-   FATX_UNLOCK(fatx_h);
-   return entry;
+   pthread_mutex_unlock(&fatx_h->fatLock);
+   return cacheEntry != NULL ? 0 : -EIO;
 }
 
-void
+int
 fatx_writeFatEntry(fatx_handle *fatx_h,
                    uint32_t     clusterNo,
                    uint32_t     value)
 {
-   uint32_t pageNo, entryNo;
+   uint32_t pageNo, entryNo, oldValue;
    fatx_fat_cache_entry * cacheEntry;
-   FATX_LOCK(fatx_h);
-   if (fatx_h->fatType == FATX32) {
-      pageNo = clusterNo / FATX32_ENTRIES_PER_PAGE;
-      entryNo = clusterNo & (FATX32_ENTRIES_PER_PAGE - 1);
-      cacheEntry = fatx_getFatPage(fatx_h, pageNo);
-      cacheEntry->dirty = 1;
-      cacheEntry->fatx32Entries[entryNo] = SWAP32(value);
+   if (fatx_readFatEntry(fatx_h, clusterNo, &oldValue))
+      return -EIO;
+   pthread_mutex_lock(&fatx_h->fatLock);
+   if (fatx_h->fat != NULL) {
+      fatx_h->fat[clusterNo] = value;
+      fatx_h->fatDirty[((size_t) clusterNo << fatx_h->fatType) / FAT_PAGE_SZ] = 1;
+   } else if (fatx_h->map != NULL) {
+      if (fatx_h->fatType == FATX32)
+         ((uint32_t *) (fatx_h->map + FAT_OFFSET))[clusterNo] = SWAP32(value);
+      else
+         ((uint16_t *) (fatx_h->map + FAT_OFFSET))[clusterNo] = SWAP16(value);
    } else {
-      pageNo = clusterNo / FATX16_ENTRIES_PER_PAGE;
-      entryNo = clusterNo & (FATX16_ENTRIES_PER_PAGE - 1);
+      pageNo = (clusterNo << fatx_h->fatType) / FAT_PAGE_SZ;
       cacheEntry = fatx_getFatPage(fatx_h, pageNo);
+      if (cacheEntry == NULL) {
+         pthread_mutex_unlock(&fatx_h->fatLock);
+         return -EIO;
+      }
       cacheEntry->dirty = 1;
-      cacheEntry->fatx16Entries[entryNo] = SWAP16(value);
+      if (fatx_h->fatType == FATX32) {
+         entryNo = clusterNo & (FATX32_ENTRIES_PER_PAGE - 1);
+         cacheEntry->fatx32Entries[entryNo] = SWAP32(value);
+      } else {
+         entryNo = clusterNo & (FATX16_ENTRIES_PER_PAGE - 1);
+         cacheEntry->fatx16Entries[entryNo] = SWAP16(value);
+      }
    }
-   FATX_UNLOCK(fatx_h);
+   pthread_mutex_unlock(&fatx_h->fatLock);
+   if (IS_FREE_CLUSTER(oldValue) != IS_FREE_CLUSTER(value))
+      fatx_setClusterFree(fatx_h, clusterNo, IS_FREE_CLUSTER(value));
+   fatx_noteDirty(fatx_h);
+   return 0;
 }
 
 uint32_t
 fatx_findFreeCluster(fatx_handle * fatx_h,
                      uint32_t      startClusterNo)
 {
-   startClusterNo = (startClusterNo + 1) % fatx_h->nClusters;
-   FATX_LOCK(fatx_h);
-   while(!IS_FREE_CLUSTER(fatx_readFatEntry(fatx_h, startClusterNo)))
-      startClusterNo = (startClusterNo + 1) % fatx_h->nClusters;
-   FATX_UNLOCK(fatx_h);
-   return startClusterNo;
+   uint32_t clusterNo = 0;
+   if(fatx_h->nFreeClusters == 0)
+      return 0;
+   // Search towards the end of the FAT first, then wrap around.
+   if(startClusterNo < fatx_h->nClusters)
+      clusterNo = fatx_scanFreeMap(fatx_h, startClusterNo + 1, fatx_h->nClusters);
+   if(clusterNo == 0)
+      clusterNo = fatx_scanFreeMap(fatx_h, 1, MIN(startClusterNo + 1, fatx_h->nClusters));
+   return clusterNo;
+}
+
+uint32_t
+fatx_scanFreeMap(fatx_handle * fatx_h,
+                 uint32_t      from,
+                 uint32_t      to)
+{
+   uint32_t entriesPerPage = FAT_PAGE_SZ >> fatx_h->fatType;
+   uint64_t word;
+   while(from < to) {
+      // Skip whole FAT pages without a free cluster.
+      if(from % entriesPerPage == 0 && fatx_h->freeCount[from / entriesPerPage] == 0) {
+         from += entriesPerPage;
+         continue;
+      }
+      word = fatx_h->freeMap[from / 64] & (~0ULL << (from % 64));
+      if(word) {
+         from = (from & ~63U) + CTZ64(word);
+         return from < to ? from : 0;
+      }
+      from = (from | 63) + 1;
+   }
+   return 0;
+}
+
+uint32_t
+fatx_freeRunLength(fatx_handle * fatx_h,
+                   uint32_t      clusterNo,
+                   uint32_t      max)
+{
+   uint32_t length = 0;
+   uint64_t word;
+   max = MIN(max, fatx_h->nClusters - clusterNo);
+   while(length < max) {
+      // Count the free bits in a row from here within this word.
+      word = ~fatx_h->freeMap[(clusterNo + length) / 64] >> ((clusterNo + length) % 64);
+      if(word == 0) {
+         length += 64 - (clusterNo + length) % 64;
+         continue;
+      }
+      length += CTZ64(word);
+      break;
+   }
+   return MIN(length, max);
+}
+
+uint32_t
+fatx_findFreeRun(fatx_handle * fatx_h,
+                 uint32_t      startingCluster,
+                 uint32_t      count)
+{
+   uint32_t clusterNo, from, to, length, pass;
+   if(count > fatx_h->nFreeClusters)
+      return 0;
+   for(pass = 0; pass < 2; pass++) {
+      from = pass ? 1 : MIN(startingCluster + 1, fatx_h->nClusters);
+      to = pass ? MIN(startingCluster + 1, fatx_h->nClusters) : fatx_h->nClusters;
+      while(from < to) {
+         clusterNo = fatx_scanFreeMap(fatx_h, from, to);
+         if(clusterNo == 0)
+            break;
+         length = fatx_freeRunLength(fatx_h, clusterNo, count);
+         if(length == count)
+            return clusterNo;
+         from = clusterNo + length;
+      }
+   }
+   return 0;
+}
+
+uint32_t
+fatx_findBestFreeRun(fatx_handle * fatx_h,
+                     uint32_t      startingCluster,
+                     uint32_t      count,
+                     uint32_t      maxRuns,
+                     uint32_t    * length)
+{
+   uint32_t clusterNo, runLength, from, to, pass;
+   uint32_t noRuns = 0, best = 0, bestLength = 0;
+   *length = 0;
+   if(count == 0 || fatx_h->nFreeClusters == 0)
+      return 0;
+   // Following on from the starting cluster keeps the chain in one run.
+   if(startingCluster + 1 < fatx_h->nClusters &&
+      fatx_freeRunLength(fatx_h, startingCluster + 1, count) == count) {
+      *length = count;
+      return startingCluster + 1;
+   }
+   for(pass = 0; pass < 2; pass++) {
+      from = pass ? 1 : MIN(startingCluster + 1, fatx_h->nClusters);
+      to = pass ? MIN(startingCluster + 1, fatx_h->nClusters) : fatx_h->nClusters;
+      while(from < to) {
+         clusterNo = fatx_scanFreeMap(fatx_h, from, to);
+         if(clusterNo == 0)
+            break;
+         runLength = fatx_freeRunLength(fatx_h, clusterNo, fatx_h->nClusters);
+         if(runLength == count) {
+            best = clusterNo;
+            bestLength = runLength;
+            goto finish;
+         }
+         // Until a run fits the longest one is kept, then the shortest
+         // one that fits.
+         if(bestLength < count ? runLength > bestLength :
+                                 runLength > count && runLength < bestLength) {
+            best = clusterNo;
+            bestLength = runLength;
+         }
+         if(maxRuns != 0 && ++noRuns == maxRuns)
+            goto finish;
+         from = clusterNo + runLength;
+      }
+   }
+finish:
+   *length = MIN(bestLength, count);
+   return best;
+}
+
+int
+fatx_writeFatRun(fatx_handle * fatx_h,
+                 uint32_t      firstCluster,
+                 uint32_t      count,
+                 uint32_t      last)
+{
+   uint32_t               entriesPerPage = FAT_PAGE_SZ >> fatx_h->fatType;
+   uint32_t               end = firstCluster + count;
+   uint32_t               clusterNo, pageNo, pageEnd, value;
+   fatx_fat_cache_entry * cacheEntry;
+   fatx_extent            written;
+   pthread_mutex_lock(&fatx_h->fatLock);
+   for(clusterNo = firstCluster; clusterNo < end; clusterNo = pageEnd) {
+      pageNo = clusterNo / entriesPerPage;
+      pageEnd = MIN(end, (pageNo + 1) * entriesPerPage);
+      cacheEntry = NULL;
+      if(fatx_h->fat != NULL)
+         fatx_h->fatDirty[pageNo] = 1;
+      else if(fatx_h->map == NULL) {
+         cacheEntry = fatx_getFatPage(fatx_h, pageNo);
+         if(cacheEntry == NULL)
+            goto error;
+         cacheEntry->dirty = 1;
+      }
+      for(; clusterNo < pageEnd; clusterNo++) {
+         fatx_setClusterFree(fatx_h, clusterNo, 0);
+         value = clusterNo + 1 < end ? clusterNo + 1 : last;
+         if(fatx_h->fat != NULL)
+            fatx_h->fat[clusterNo] = value;
+         else if(fatx_h->map != NULL && fatx_h->fatType == FATX32)
+            ((uint32_t *) (fatx_h->map + FAT_OFFSET))[clusterNo] = SWAP32(value);
+         else if(fatx_h->map != NULL)
+            ((uint16_t *) (fatx_h->map + FAT_OFFSET))[clusterNo] = SWAP16(value);
+         else if(fatx_h->fatType == FATX32)
+            cacheEntry->fatx32Entries[clusterNo % entriesPerPage] = SWAP32(value);
+         else
+            cacheEntry->fatx16Entries[clusterNo % entriesPerPage] = SWAP16(value);
+      }
+   }
+   pthread_mutex_unlock(&fatx_h->fatLock);
+   fatx_noteDirty(fatx_h);
+   return 0;
+
+error:
+   // Give back the part of the run that was already chained.
+   pthread_mutex_unlock(&fatx_h->fatLock);
+   if(clusterNo > firstCluster) {
+      written.fileClusterNo = 0;
+      written.clusterNo = firstCluster;
+      written.length = clusterNo - firstCluster;
+      fatx_clearFatRuns(fatx_h, &written, 1);
+   }
+   return -EIO;
+}
+
+int
+fatx_allocRun(fatx_handle * fatx_h,
+              uint32_t      startingCluster,
+              uint32_t      count,
+              uint32_t      maxRuns,
+              uint32_t    * clusterNo,
+              uint32_t    * length)
+{
+   *clusterNo = fatx_findBestFreeRun(fatx_h, startingCluster, count, maxRuns, length);
+   if(*clusterNo == 0)
+      return -ENOSPC;
+   return fatx_writeFatRun(fatx_h, *clusterNo, *length, FATX_EOC(fatx_h));
+}
+
+int
+fatx_allocClusters(fatx_handle * fatx_h,
+                   uint32_t      startingCluster,
+                   uint32_t      count,
+                   uint32_t    * firstCluster)
+{
+   uint32_t    clusterNo, length;
+   uint32_t    prevCluster = 0;
+   fatx_extent run;
+   int         err = 0;
+   if(count == 0 || count > fatx_h->nFreeClusters)
+      return -ENOSPC;
+   *firstCluster = 0;
+   while(count > 0) {
+      err = fatx_allocRun(fatx_h, prevCluster ? prevCluster : startingCluster, count,
+                          0, &clusterNo, &length);
+      if(err)
+         goto error;
+      if(prevCluster != 0) {
+         err = fatx_writeFatEntry(fatx_h, prevCluster, clusterNo);
+         if(err) {
+            run.fileClusterNo = 0;
+            run.clusterNo = clusterNo;
+            run.length = length;
+            fatx_clearFatRuns(fatx_h, &run, 1);
+            goto error;
+         }
+      } else {
+         *firstCluster = clusterNo;
+      }
+      prevCluster = clusterNo + length - 1;
+      count -= length;
+   }
+   return 0;
+
+error:
+   // The runs chained so far end in an end of chain marker.
+   if(*firstCluster != 0)
+      fatx_freeChain(fatx_h, *firstCluster);
+   *firstCluster = 0;
+   return err;
+}
+
+int
+fatx_reserveClusters(fatx_handle * fatx_h,
+                     uint32_t      firstCluster,
+                     uint32_t      count)
+{
+   fatx_extent_map * map;
+   fatx_extent     * extent;
+   uint32_t          noClusters, lastCluster, newCluster;
+   int               err;
+   pthread_mutex_lock(&fatx_h->extentLock);
+   map = fatx_getExtentMap(fatx_h, firstCluster);
+   if(map == NULL || map->noExtents == 0) {
+      pthread_mutex_unlock(&fatx_h->extentLock);
+      return map == NULL ? -ENOMEM : -EBADF;
+   }
+   extent = map->extents + map->noExtents - 1;
+   noClusters = extent->fileClusterNo + extent->length;
+   lastCluster = extent->clusterNo + extent->length - 1;
+   pthread_mutex_unlock(&fatx_h->extentLock);
+   if(count <= noClusters)
+      return 0;
+   // Searching from the last cluster takes the run right after it first.
+   err = fatx_allocClusters(fatx_h, lastCluster, count - noClusters, &newCluster);
+   if(err)
+      return err;
+   err = fatx_writeFatEntry(fatx_h, lastCluster, newCluster);
+   if(err) {
+      fatx_freeChain(fatx_h, newCluster);
+      return err;
+   }
+   fatx_invalidateExtentMap(fatx_h, firstCluster);
+   return 0;
+}
+
+int
+fatx_freeChain(fatx_handle * fatx_h,
+               uint32_t      firstCluster)
+{
+   fatx_extent_map * map;
+   fatx_extent     * runs = NULL;
+   uint32_t          noRuns = 0;
+   uint32_t          clusterNo = firstCluster;
+   uint32_t          nextCluster, i;
+   int               err = 0;
+   // The extent map already holds the chain as runs.
+   pthread_mutex_lock(&fatx_h->extentLock);
+   map = fatx_getExtentMap(fatx_h, firstCluster);
+   if(map != NULL && map->noExtents > 0) {
+      runs = (fatx_extent *) malloc(map->noExtents * sizeof(fatx_extent));
+      if(runs != NULL) {
+         memcpy(runs, map->extents, map->noExtents * sizeof(fatx_extent));
+         noRuns = map->noExtents;
+      }
+   }
+   pthread_mutex_unlock(&fatx_h->extentLock);
+   if(runs != NULL) {
+      // A map that missed a cluster linked onto the chain would leak it.
+      if(fatx_readFatEntry(fatx_h, runs[noRuns - 1].clusterNo + runs[noRuns - 1].length - 1,
+                           &nextCluster) ||
+         (!IS_FREE_CLUSTER(nextCluster) && nextCluster < fatx_h->nClusters)) {
+         free(runs);
+         runs = NULL;
+      }
+   }
+   if(runs != NULL) {
+      err = fatx_clearFatRuns(fatx_h, runs, noRuns);
+      free(runs);
+   } else {
+      // Bound the walk by the cluster count so a looping chain can't hang us.
+      for(i = 0; i < fatx_h->nClusters; i++) {
+         if(IS_FREE_CLUSTER(clusterNo) || clusterNo >= fatx_h->nClusters)
+            break;
+         err = fatx_readFatEntry(fatx_h, clusterNo, &nextCluster);
+         if(err == 0)
+            err = fatx_writeFatEntry(fatx_h, clusterNo, 0);
+         if(err)
+            break;
+         clusterNo = nextCluster;
+      }
+   }
+   fatx_invalidateExtentMap(fatx_h, firstCluster);
+   fatx_h->chainGen++;
+   return err;
+}
+
+int
+fatx_clearFatRuns(fatx_handle * fatx_h,
+                  fatx_extent * runs,
+                  uint32_t      noRuns)
+{
+   uint32_t               entriesPerPage = FAT_PAGE_SZ >> fatx_h->fatType;
+   uint32_t               pageNo = UINT32_MAX;
+   uint32_t               clusterNo, end, value, i;
+   fatx_fat_cache_entry * cacheEntry = NULL;
+   int                    err = 0;
+   qsort(runs, noRuns, sizeof(fatx_extent), fatx_compareExtents);
+   pthread_mutex_lock(&fatx_h->fatLock);
+   for(i = 0; i < noRuns; i++) {
+      end = runs[i].clusterNo + runs[i].length;
+      for(clusterNo = runs[i].clusterNo; clusterNo < end; clusterNo++) {
+         if(clusterNo / entriesPerPage != pageNo) {
+            pageNo = clusterNo / entriesPerPage;
+            if(fatx_h->fat != NULL)
+               fatx_h->fatDirty[pageNo] = 1;
+            else if(fatx_h->map == NULL) {
+               cacheEntry = fatx_getFatPage(fatx_h, pageNo);
+               if(cacheEntry != NULL)
+                  cacheEntry->dirty = 1;
+            }
+         }
+         if(fatx_h->fat == NULL && fatx_h->map == NULL && cacheEntry == NULL) {
+            // The page couldn't be read; its clusters stay allocated.
+            err = -EIO;
+            continue;
+         }
+         if(fatx_h->fat != NULL) {
+            value = fatx_h->fat[clusterNo];
+            fatx_h->fat[clusterNo] = 0;
+         } else if(fatx_h->map != NULL && fatx_h->fatType == FATX32) {
+            value = ((uint32_t *) (fatx_h->map + FAT_OFFSET))[clusterNo];
+            ((uint32_t *) (fatx_h->map + FAT_OFFSET))[clusterNo] = 0;
+         } else if(fatx_h->map != NULL) {
+            value = ((uint16_t *) (fatx_h->map + FAT_OFFSET))[clusterNo];
+            ((uint16_t *) (fatx_h->map + FAT_OFFSET))[clusterNo] = 0;
+         } else if(fatx_h->fatType == FATX32) {
+            value = cacheEntry->fatx32Entries[clusterNo % entriesPerPage];
+            cacheEntry->fatx32Entries[clusterNo % entriesPerPage] = 0;
+         } else {
+            value = cacheEntry->fatx16Entries[clusterNo % entriesPerPage];
+            cacheEntry->fatx16Entries[clusterNo % entriesPerPage] = 0;
+         }
+         // A looping chain can list a cluster twice.
+         if(value != 0)
+            fatx_setClusterFree(fatx_h, clusterNo, 1);
+      }
+   }
+   pthread_mutex_unlock(&fatx_h->fatLock);
+   fatx_noteDirty(fatx_h);
+   return err;
+}
+
+int
+fatx_truncateChain(fatx_handle * fatx_h,
+                   uint32_t      firstCluster,
+                   uint32_t      count)
+{
+   uint32_t lastCluster, nextCluster;
+   int      err;
+   lastCluster = fatx_mapCluster(fatx_h, firstCluster, MAX(count, 1) - 1, NULL);
+   if(lastCluster == 0)
+      return -EBADF;
+   if(fatx_readFatEntry(fatx_h, lastCluster, &nextCluster))
+      return -EIO;
+   if(IS_FREE_CLUSTER(nextCluster) || nextCluster >= fatx_h->nClusters)
+      return 0;
+   err = fatx_writeFatEntry(fatx_h, lastCluster, FATX_EOC(fatx_h));
+   if(err == 0)
+      err = fatx_freeChain(fatx_h, nextCluster);
+   fatx_invalidateExtentMap(fatx_h, firstCluster);
+   return err;
+}
+
+int
+fatx_buildFreeMap(fatx_handle * fatx_h)
+{
+   uint32_t   entriesPerPage = FAT_PAGE_SZ >> fatx_h->fatType;
+   uint32_t   noPages = fatx_h->fatSize / FAT_PAGE_SZ;
+   uint32_t   clusterNo, chunkStart = 0, entry;
+   size_t     chunkSz = 0;
+   char     * buf = NULL;
+   fatx_h->freeMap = (uint64_t *) calloc((fatx_h->nClusters + 63) / 64, sizeof(uint64_t));
+   fatx_h->freeCount = (uint16_t *) calloc(noPages, sizeof(uint16_t));
+   if(fatx_h->freeMap == NULL || fatx_h->freeCount == NULL)
+      goto error;
+   if(fatx_h->fat == NULL && fatx_h->map == NULL) {
+      // Stream the FAT straight from disk rather than through the page cache.
+      buf = (char *) malloc(FAT_IO_PAGES * FAT_PAGE_SZ);
+      if(buf == NULL)
+         goto error;
+   }
+   fatx_h->nFreeClusters = 0;
+   for(clusterNo = 1; clusterNo < fatx_h->nClusters; clusterNo++) {
+      if(fatx_h->fat != NULL || fatx_h->map != NULL) {
+         // A resident or mapped FAT is never read from the device here.
+         fatx_readFatEntry(fatx_h, clusterNo, &entry);
+      } else {
+         if(clusterNo - chunkStart >= (chunkSz >> fatx_h->fatType) || chunkSz == 0) {
+            chunkStart = clusterNo - (clusterNo % entriesPerPage);
+            chunkSz = MIN((size_t) FAT_IO_PAGES, noPages - chunkStart / entriesPerPage) *
+                      FAT_PAGE_SZ;
+            if(fatx_devRead(fatx_h, buf, chunkSz,
+                            FAT_OFFSET + ((off_t) chunkStart << fatx_h->fatType)))
+               goto error;
+         }
+         if(fatx_h->fatType == FATX32)
+            entry = ((uint32_t *) buf)[clusterNo - chunkStart];
+         else
+            entry = ((uint16_t *) buf)[clusterNo - chunkStart];
+      }
+      if(IS_FREE_CLUSTER(entry))
+         fatx_setClusterFree(fatx_h, clusterNo, 1);
+   }
+   free(buf);
+   return 0;
+
+error:
+   free(buf);
+   free(fatx_h->freeMap);
+   free(fatx_h->freeCount);
+   fatx_h->freeMap = NULL;
+   fatx_h->freeCount = NULL;
+   return -1;
+}
+
+void
+fatx_setClusterFree(fatx_handle * fatx_h,
+                    uint32_t      clusterNo,
+                    char          isFree)
+{
+   uint32_t pageNo = ((size_t) clusterNo << fatx_h->fatType) / FAT_PAGE_SZ;
+   uint64_t bit = 1ULL << (clusterNo % 64);
+   if(isFree) {
+      fatx_h->freeMap[clusterNo / 64] |= bit;
+      fatx_h->freeCount[pageNo]++;
+      fatx_h->nFreeClusters++;
+   } else {
+      fatx_h->freeMap[clusterNo / 64] &= ~bit;
+      fatx_h->freeCount[pageNo]--;
+      fatx_h->nFreeClusters--;
+   }
 }
 
 char
@@ -134,386 +642,2324 @@ fatx_getFatPage(fatx_handle * fatx_h,
                 uint32_t      pageNo)
 {
    fatx_fat_cache_entry * entry = NULL;
-   FATX_LOCK(fatx_h);
    entry = fatx_h->fatCache + (pageNo % FAT_CACHE_SIZE);
    if(entry->pageNo != pageNo) {
-      if(entry->dirty) fatx_flushFatCacheEntry(fatx_h, entry);
-      fatx_loadFatPage(fatx_h, pageNo);
+      // A page that can't be written back keeps its slot.
+      if(entry->dirty && fatx_flushFatCacheEntry(fatx_h, entry))
+         return NULL;
+      if(fatx_loadFatPage(fatx_h, pageNo))
+         return NULL;
    }
-   FATX_UNLOCK(fatx_h);
    return entry;
 }
 
-void
+int
 fatx_loadFatPage(fatx_handle * fatx_h,
                  uint32_t      pageNo)
 {
    fatx_fat_cache_entry * entry = fatx_h->fatCache + (pageNo % FAT_CACHE_SIZE);
-   int                    i;
-   uint16_t               lastFreeCluster;
-   FATX_LOCK(fatx_h);
-   lseek(fatx_h->dev, FAT_OFFSET + (pageNo * FAT_PAGE_SZ), SEEK_SET);
-   read(fatx_h->dev, entry->data, FAT_PAGE_SZ);
    entry->dirty = 0;
+   // A page that couldn't be read isn't cached, so the next access retries.
+   if(fatx_devRead(fatx_h, entry->data, FAT_PAGE_SZ, FAT_OFFSET + (pageNo * FAT_PAGE_SZ))) {
+      entry->pageNo = FAT_PAGE_NONE;
+      return -EIO;
+   }
    entry->pageNo = pageNo;
-   FATX_UNLOCK(fatx_h);
+   return 0;
 }
 
-void
+int
+fatx_loadResidentFat(fatx_handle * fatx_h)
+{
+   size_t    nEntries = fatx_h->fatSize >> fatx_h->fatType;
+   char    * raw;
+   size_t    i;
+   fatx_h->fat = (uint32_t *) malloc(nEntries * sizeof(uint32_t));
+   fatx_h->fatDirty = (char *) calloc(fatx_h->fatSize / FAT_PAGE_SZ, 1);
+   if(fatx_h->fat == NULL || fatx_h->fatDirty == NULL)
+      goto error;
+   // Read the on disk FAT into the tail of the array. For FATX16 the host
+   // order entries are twice as wide, and converting front to back never
+   // overwrites a raw entry before it has been read.
+   raw = ((char *) fatx_h->fat) + (nEntries * sizeof(uint32_t)) - fatx_h->fatSize;
+   if(fatx_devRead(fatx_h, raw, fatx_h->fatSize, FAT_OFFSET))
+      goto error;
+   if(fatx_h->fatType == FATX32) {
+      for(i = 0; i < nEntries; i++)
+         fatx_h->fat[i] = SWAP32(((uint32_t *) raw)[i]);
+   } else {
+      for(i = 0; i < nEntries; i++)
+         fatx_h->fat[i] = SWAP16(((uint16_t *) raw)[i]);
+   }
+   return 0;
+
+error:
+   free(fatx_h->fat);
+   free(fatx_h->fatDirty);
+   fatx_h->fat = NULL;
+   fatx_h->fatDirty = NULL;
+   return -1;
+}
+
+int
+fatx_flushResidentFat(fatx_handle * fatx_h)
+{
+   uint32_t   noPages = fatx_h->fatSize / FAT_PAGE_SZ;
+   uint32_t   entriesPerPage = FAT_PAGE_SZ >> fatx_h->fatType;
+   uint32_t   pageNo, endPageNo, i, first;
+   char     * buf;
+   int        err = 0;
+   buf = (char *) malloc(FAT_IO_PAGES * FAT_PAGE_SZ);
+   if(buf == NULL)
+      return -ENOMEM;
+   for(pageNo = 0; pageNo < noPages; pageNo = endPageNo) {
+      if(!fatx_h->fatDirty[pageNo]) {
+         endPageNo = pageNo + 1;
+         continue;
+      }
+      // Collect the run of dirty pages and convert it back to disk order.
+      for(endPageNo = pageNo; endPageNo < noPages && fatx_h->fatDirty[endPageNo] &&
+                              endPageNo - pageNo < FAT_IO_PAGES; endPageNo++);
+      first = pageNo * entriesPerPage;
+      for(i = 0; i < (endPageNo - pageNo) * entriesPerPage; i++) {
+         if(fatx_h->fatType == FATX32)
+            ((uint32_t *) buf)[i] = SWAP32(fatx_h->fat[first + i]);
+         else
+            ((uint16_t *) buf)[i] = SWAP16(fatx_h->fat[first + i]);
+      }
+      // Pages that didn't make it stay dirty for the next flush.
+      if(fatx_devWrite(fatx_h, buf, (endPageNo - pageNo) * FAT_PAGE_SZ,
+                       FAT_OFFSET + (pageNo * FAT_PAGE_SZ))) {
+         err = -EIO;
+         continue;
+      }
+      memset(fatx_h->fatDirty + pageNo, 0, endPageNo - pageNo);
+   }
+   free(buf);
+   return err;
+}
+
+int
 fatx_flushFatCacheEntry(fatx_handle          * fatx_h,
                         fatx_fat_cache_entry * cacheEntry)
 {
-   FATX_LOCK(fatx_h);
-   lseek(fatx_h->dev, FAT_OFFSET + (cacheEntry->pageNo * FAT_PAGE_SZ), SEEK_SET);
-   write(fatx_h->dev, cacheEntry->data, FAT_PAGE_SZ);
+   if(fatx_devWrite(fatx_h, cacheEntry->data, FAT_PAGE_SZ,
+                    FAT_OFFSET + (cacheEntry->pageNo * FAT_PAGE_SZ)))
+      return -EIO;
    cacheEntry->dirty = 0;
-   FATX_UNLOCK(fatx_h);
+   return 0;
 }
 
 fatx_cache_entry * 
 fatx_getCluster(fatx_handle * fatx_h, 
                 uint32_t      clusterNo)
 {
-   fatx_cache_entry * cacheEntry;
-   FATX_LOCK(fatx_h);
-   cacheEntry = &fatx_h->cache[clusterNo % CACHE_SIZE];
-   if(cacheEntry->clusterNo != clusterNo) {
-      if(cacheEntry->dirty) fatx_flushClusterCacheEntry(fatx_h, cacheEntry);
-      fatx_loadCluster(fatx_h, clusterNo);
+   uint32_t           setNo = clusterNo % fatx_h->cacheSets;
+   fatx_cache_set   * set = fatx_h->sets + setNo;
+   fatx_cache_entry * ways = fatx_h->cache + setNo * CACHE_WAYS;
+   fatx_cache_entry * cacheEntry = NULL;
+   uint32_t           i;
+   pthread_mutex_lock(&set->lock);
+   for(;;) {
+      for(i = 0; i < CACHE_WAYS; i++) {
+         if(ways[i].valid && ways[i].clusterNo == clusterNo) {
+            cacheEntry = ways + i;
+            goto finish;
+         }
+      }
+      // Miss, replace the least recently used way that isn't in use. Unused
+      // ways have never been touched so they go first.
+      for(i = 0; i < CACHE_WAYS; i++) {
+         if(ways[i].refCount == 0 &&
+            (cacheEntry == NULL || ways[i].lastUsed < cacheEntry->lastUsed))
+            cacheEntry = ways + i;
+      }
+      if(cacheEntry != NULL)
+         break;
+      // Every way is pinned, wait for one to be released.
+      pthread_cond_wait(&set->released, &set->lock);
    }
-   FATX_UNLOCK(fatx_h);
+   // A cluster that can't be written back stays cached.
+   if((cacheEntry->dirty && fatx_flushClusterCacheEntry(fatx_h, cacheEntry)) ||
+      fatx_loadCluster(fatx_h, cacheEntry, clusterNo)) {
+      pthread_mutex_unlock(&set->lock);
+      return NULL;
+   }
+finish:
+   cacheEntry->refCount++;
+   cacheEntry->lastUsed = ++set->clock;
+   pthread_mutex_unlock(&set->lock);
    return cacheEntry;
 }
 
 void
-fatx_flushClusterCacheEntry(fatx_handle      * fatx_h,
-                            fatx_cache_entry * cacheEntry)
+fatx_releaseCluster(fatx_handle      * fatx_h,
+                    fatx_cache_entry * cacheEntry)
 {
-   FATX_LOCK(fatx_h);
-   off_t fileOffset = cacheEntry->clusterNo;
-   fileOffset *= FAT_CLUSTER_SZ;
-   lseek(fatx_h->dev, fatx_h->dataStart + fileOffset, SEEK_SET);
-   write(fatx_h->dev, cacheEntry->data, FAT_CLUSTER_SZ);
-   cacheEntry->dirty = 0;
-   FATX_UNLOCK(fatx_h);
+   fatx_cache_set * set = fatx_h->sets + (cacheEntry - fatx_h->cache) / CACHE_WAYS;
+   pthread_mutex_lock(&set->lock);
+   if(--cacheEntry->refCount == 0)
+      pthread_cond_signal(&set->released);
+   pthread_mutex_unlock(&set->lock);
 }
 
-void 
-fatx_loadCluster(fatx_handle * fatx_h, 
-                 uint32_t      clusterNo)
+fatx_cache_entry *
+fatx_lookupCluster(fatx_handle * fatx_h,
+                   uint32_t      clusterNo)
 {
-   FATX_LOCK(fatx_h);
-   fatx_cache_entry * cacheEntry = &fatx_h->cache[clusterNo % CACHE_SIZE];
-   off_t fileOffset = clusterNo;
-   fileOffset *= FAT_CLUSTER_SZ;
-   lseek(fatx_h->dev, fatx_h->dataStart + fileOffset, SEEK_SET);
-   read(fatx_h->dev, cacheEntry->data, FAT_CLUSTER_SZ);
-   cacheEntry->clusterNo = clusterNo;
-   cacheEntry->dirty = 0;
-   FATX_UNLOCK(fatx_h);
+   uint32_t           setNo = clusterNo % fatx_h->cacheSets;
+   fatx_cache_entry * ways = fatx_h->cache + setNo * CACHE_WAYS;
+   fatx_cache_entry * cacheEntry = NULL;
+   uint32_t           i;
+   pthread_mutex_lock(&fatx_h->sets[setNo].lock);
+   for(i = 0; i < CACHE_WAYS; i++) {
+      if(ways[i].valid && ways[i].clusterNo == clusterNo) {
+         cacheEntry = ways + i;
+         cacheEntry->refCount++;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&fatx_h->sets[setNo].lock);
+   return cacheEntry;
 }
 
-void
-fatx_freeFilenameList(fatx_filename_list * fnList)
+int
+fatx_readClusters(fatx_handle * fatx_h,
+                  uint32_t      clusterNo,
+                  uint32_t      count,
+                  char        * buf)
 {
-   fatx_filename_list * next;
-   for(;fnList != NULL; fnList = next) {
-      next = fnList->next;
-      free(fnList);
+   off_t  fileOffset = clusterNo;
+   char * mapped;
+   fileOffset = fatx_h->dataStart + fileOffset * FAT_CLUSTER_SZ;
+   mapped = fatx_mapped(fatx_h, fileOffset, count * FAT_CLUSTER_SZ);
+   if(mapped != NULL) {
+      fatx_adviseMapped(fatx_h, fileOffset, count * FAT_CLUSTER_SZ, MADV_WILLNEED);
+      memcpy(buf, mapped, count * FAT_CLUSTER_SZ);
+      return 0;
    }
+   return fatx_devRead(fatx_h, buf, count * FAT_CLUSTER_SZ, fileOffset);
 }
 
-fatx_filename_list * 
-fatx_splitPath(const char * path)
+int
+fatx_copyClusters(fatx_handle * fatx_h,
+                  uint32_t      from,
+                  uint32_t      to,
+                  uint32_t      count)
 {
-   fatx_filename_list * list = NULL;
-   char *               filename;
-   if (path == NULL || !strncmp(path, "", 1) || !strncmp(path, "/", 2)) {
-      return NULL;
-   } else {
-      list = (fatx_filename_list *) malloc(sizeof(fatx_filename_list));
-      filename = list->filename;
-      // Skip leading /'s
-      while(*path == '/') path++;
-      while(*path != '/' && *path != '\0') {
-         *filename = *path;
-         filename++;
-         path++;
+   off_t              fromOffset = from, toOffset = to;
+   char             * fromMapped, * toMapped;
+   fatx_cache_entry * fromEntry, * toEntry;
+   uint32_t           i, j;
+   int                err;
+   fromOffset = fatx_h->dataStart + fromOffset * FAT_CLUSTER_SZ;
+   toOffset = fatx_h->dataStart + toOffset * FAT_CLUSTER_SZ;
+   // Cached clusters of a mapped image point into the mapping, so the
+   // mapping is always current.
+   fromMapped = fatx_mapped(fatx_h, fromOffset, (size_t) count * FAT_CLUSTER_SZ);
+   toMapped = fatx_mapped(fatx_h, toOffset, (size_t) count * FAT_CLUSTER_SZ);
+   if(fromMapped != NULL && toMapped != NULL) {
+      memcpy(toMapped, fromMapped, (size_t) count * FAT_CLUSTER_SZ);
+      return 0;
+   }
+   for(i = 0; i < count; i = j) {
+      fromEntry = fatx_lookupCluster(fatx_h, from + i);
+      toEntry = fatx_lookupCluster(fatx_h, to + i);
+      if(fromEntry != NULL || toEntry != NULL) {
+         if(fromEntry == NULL)
+            fromEntry = fatx_getCluster(fatx_h, from + i);
+         if(toEntry == NULL)
+            toEntry = fatx_getCluster(fatx_h, to + i);
+         if(fromEntry != NULL && toEntry != NULL) {
+            memcpy(toEntry->data, fromEntry->data, FAT_CLUSTER_SZ);
+            fatx_markClusterDirty(fatx_h, toEntry);
+         }
+         if(fromEntry != NULL)
+            fatx_releaseCluster(fatx_h, fromEntry);
+         if(toEntry != NULL)
+            fatx_releaseCluster(fatx_h, toEntry);
+         if(fromEntry == NULL || toEntry == NULL)
+            return -EIO;
+         j = i + 1;
+         continue;
       }
-      *filename = '\0';
-      list->next = fatx_splitPath(path);
+      for(j = i + 1; j < count; j++) {
+         fromEntry = fatx_lookupCluster(fatx_h, from + j);
+         toEntry = fatx_lookupCluster(fatx_h, to + j);
+         if(fromEntry != NULL)
+            fatx_releaseCluster(fatx_h, fromEntry);
+         if(toEntry != NULL)
+            fatx_releaseCluster(fatx_h, toEntry);
+         if(fromEntry != NULL || toEntry != NULL)
+            break;
+      }
+      err = fatx_devCopy(fatx_h, fromOffset + (off_t) i * FAT_CLUSTER_SZ,
+                         toOffset + (off_t) i * FAT_CLUSTER_SZ, (size_t) (j - i) * FAT_CLUSTER_SZ);
+      if(err)
+         return err;
    }
-   return list;
+   return 0;
 }
 
-fatx_filename_list *
-fatx_basename(fatx_filename_list * path)
+int
+fatx_copyChain(fatx_handle * fatx_h,
+               uint32_t      from,
+               uint32_t      to,
+               uint32_t      count)
 {
-   fatx_filename_list * basename;
-   if(path == NULL) return NULL;
-   while(path->next != NULL) {
-      path = path->next;
+   uint32_t fileClusterNo = 0;
+   uint32_t fromCluster, toCluster, fromRun, toRun, length;
+   int      err;
+   while(fileClusterNo < count) {
+      fromCluster = fatx_mapCluster(fatx_h, from, fileClusterNo, &fromRun);
+      toCluster = fatx_mapCluster(fatx_h, to, fileClusterNo, &toRun);
+      if(fromCluster == 0 || toCluster == 0)
+         return -EBADF;
+      length = MIN(MIN(fromRun, toRun), count - fileClusterNo);
+      err = fatx_copyClusters(fatx_h, fromCluster, toCluster, length);
+      if(err)
+         return err;
+      fileClusterNo += length;
    }
-   basename = (fatx_filename_list *) malloc(sizeof(fatx_filename_list));
-   memcpy(basename, path, sizeof(fatx_filename_list));
-   return basename;
+   return 0;
 }
 
-fatx_filename_list *
-fatx_dirname(fatx_filename_list * path)
+int
+fatx_mapImage(fatx_handle * fatx_h)
 {
-   fatx_filename_list * dirname;
-   if(path == NULL || path->next == NULL) return NULL;
-   dirname = (fatx_filename_list *) malloc(sizeof(fatx_filename_list));
-   memcpy(dirname, path, sizeof(fatx_filename_list));
-   dirname->next = fatx_dirname(path->next);
-   return dirname;
+   struct stat statBuf;
+   void      * map;
+   if(fstat(fatx_h->dev, &statBuf) || !S_ISREG(statBuf.st_mode) || statBuf.st_size == 0)
+      return -1;
+   map = mmap(NULL, statBuf.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fatx_h->dev, 0);
+   if(map == MAP_FAILED)
+      return -1;
+   fatx_h->map = (char *) map;
+   fatx_h->mapSize = statBuf.st_size;
+   // Clusters are looked up all over the place, but the FAT is always needed.
+   madvise(fatx_h->map, fatx_h->mapSize, MADV_RANDOM);
+   fatx_adviseMapped(fatx_h, FAT_OFFSET, fatx_h->fatSize, MADV_WILLNEED);
+   return 0;
 }
 
-void
-fatx_printFilenameList(fatx_filename_list * fnList)
+char *
+fatx_mapped(fatx_handle * fatx_h,
+            off_t         offset,
+            size_t        len)
 {
-   if(fnList == NULL) {
-      printf("/\n");
-      return;
-   }
-   while(fnList != NULL) {
-      printf("/%s", fnList->filename);
-      fnList = fnList->next;
-   }
-   printf("\n");
+   if(fatx_h->map == NULL || offset < 0 || (size_t) offset + len > fatx_h->mapSize)
+      return NULL;
+   return fatx_h->map + offset;
 }
 
-fatx_dir_iter *
-fatx_createDirIter(fatx_handle *          fatx_h,
-                   fatx_directory_entry * directoryEntry)
+void
+fatx_adviseMapped(fatx_handle * fatx_h,
+                  off_t         offset,
+                  size_t        len,
+                  int           advice)
 {
-   fatx_dir_iter        * iter = NULL;
-   uint32_t               clusterNo = 1;
-   FATX_LOCK(fatx_h);
-   if (directoryEntry != NULL) {
-      if(!IS_VALID_ENTRY(directoryEntry) || !IS_FOLDER(directoryEntry))
-         goto finish;
-      clusterNo = SWAP32(directoryEntry->firstCluster);
-   } 
-   iter = (fatx_dir_iter *) malloc(sizeof(fatx_dir_iter));
-   iter->fatx_h = fatx_h;
-   iter->entryNo = 0;
-   iter->clusterNo = clusterNo;
-   iter->dirEntList = NULL;
-finish:
-   FATX_UNLOCK(fatx_h);
-   return iter;
+   size_t pageSz = sysconf(_SC_PAGESIZE);
+   size_t start, end;
+   if(fatx_h->map == NULL || offset < 0 || (size_t) offset >= fatx_h->mapSize)
+      return;
+   start = offset & ~(pageSz - 1);
+   end = MIN((size_t) offset + len, fatx_h->mapSize);
+   madvise(fatx_h->map + start, end - start, advice);
 }
 
-fatx_directory_entry *
-fatx_readDirectoryEntry(fatx_handle *   fatx_h,
-                        fatx_dir_iter * iter)
+
+void
+fatx_adviseRead(fatx_handle * fatx_h,
+                off_t         offset,
+                size_t        len)
 {
-   fatx_directory_entry   * directoryEntry = NULL;
-   fatx_cache_entry       * cacheEntry;
-   uint32_t                 nextCluster;
-   FATX_LOCK(iter->fatx_h);
-   if(iter->entryNo == DIR_ENTRIES_PER_CLUSTER) {
-      nextCluster = fatx_readFatEntry(fatx_h, iter->clusterNo);
-      if (fatx_isEOC(fatx_h, nextCluster)) goto finish;
-      iter->entryNo = 0;
-      iter->clusterNo = nextCluster;
-   }
-   cacheEntry = fatx_getCluster(iter->fatx_h, iter->clusterNo);
-   directoryEntry = &cacheEntry->dirEntries[iter->entryNo];
-   if(directoryEntry->filenameSz == 0xFF) {
-      directoryEntry = NULL;
-      goto finish;
+#if defined(F_RDADVISE)
+   struct radvisory advisory;
+#endif
+   if(fatx_h->map != NULL) {
+      fatx_adviseMapped(fatx_h, offset, len, MADV_WILLNEED);
+      return;
    }
-   iter->entryNo++;
-finish:
-   FATX_UNLOCK(iter->fatx_h);
-   return directoryEntry;
+#if defined(F_RDADVISE)
+   advisory.ra_offset = offset;
+   advisory.ra_count = len;
+   fcntl(fatx_h->dev, F_RDADVISE, &advisory);
+#else
+   posix_fadvise(fatx_h->dev, offset, len, POSIX_FADV_WILLNEED);
+#endif
 }
-
-fatx_directory_entry *
-fatx_findDirectoryEntry(fatx_handle *          fatx_h,
-                        fatx_filename_list *   fnList,
-                        fatx_directory_entry * baseDirectoryEntry)
+int
+fatx_devRead(fatx_handle * fatx_h,
+             void        * buf,
+             size_t        len,
+             off_t         offset)
 {
-   fatx_dir_iter *        iter;
-   fatx_directory_entry * directoryEntry = NULL;
-   FATX_LOCK(fatx_h);
-   if (fnList == NULL) {
-      directoryEntry = baseDirectoryEntry;
-      goto finish;
-   }
-   iter = fatx_createDirIter(fatx_h, baseDirectoryEntry);
-   while( (directoryEntry = fatx_readDirectoryEntry(fatx_h, iter)) ) {
-      if(!IS_VALID_ENTRY(directoryEntry)) continue;
-      if(!strncmp(directoryEntry->filename, fnList->filename, directoryEntry->filenameSz)) {
-         directoryEntry = fatx_findDirectoryEntry(fatx_h, fnList->next, directoryEntry);
+   ssize_t bytesRead;
+   while(len > 0) {
+      bytesRead = pread(fatx_h->dev, buf, len, offset);
+      if(bytesRead < 0 && errno == EINTR)
+         continue;
+      if(bytesRead < 0)
+         return -EIO;
+      if(bytesRead == 0) {
+         // The last clusters of an image can lie past the end of the file.
+         // They read as zeros until they are written, like a sparse file.
+         memset(buf, 0, len);
          break;
       }
+      buf = (char *) buf + bytesRead;
+      len -= bytesRead;
+      offset += bytesRead;
    }
-   fatx_closedir(iter);
-finish:
-   FATX_UNLOCK(fatx_h);
-   return directoryEntry;
+   return 0;
 }
 
-time_t
-fatx_makeTimeType(uint16_t date, uint16_t time)
+int
+fatx_devWrite(fatx_handle * fatx_h,
+              const void  * buf,
+              size_t        len,
+              off_t         offset)
 {
-   struct tm time_struct =  {
-                               .tm_year = ((date & 0xFE00) >> 9) + 80,
-                               .tm_mon = ((date & 0x01E0) >> 5) - 1,
-                               .tm_mday = date & 0x1F,
-                               .tm_hour = time >> 11,
-                               .tm_min = (time >> 5) & 0x3F,
-                               .tm_sec = (time & 0x1F) << 1,
-                               .tm_isdst = -1,
-                               .tm_wday = 0,
-                               .tm_yday = 0,                                                                               };
-   return mktime(&time_struct);
+   ssize_t written;
+   while(len > 0) {
+      written = pwrite(fatx_h->dev, buf, len, offset);
+      if(written < 0 && errno == EINTR)
+         continue;
+      if(written <= 0)
+         return -EIO;
+      buf = (const char *) buf + written;
+      len -= written;
+      offset += written;
+   }
+   return 0;
+}
+
+int
+fatx_devCopy(fatx_handle * fatx_h,
+             off_t         from,
+             off_t         to,
+             size_t        len)
+{
+   char    * buf;
+   size_t    chunk;
+   int       err = 0;
+#if defined(__linux__)
+   loff_t    in = from, out = to;
+   ssize_t   copied;
+   // Block devices and some file systems refuse; what's left is copied by
+   // hand below.
+   while(len > 0) {
+      copied = copy_file_range(fatx_h->dev, &in, fatx_h->dev, &out, len, 0);
+      if(copied < 0 && errno == EINTR)
+         continue;
+      if(copied <= 0)
+         break;
+      len -= copied;
+   }
+   from = in;
+   to = out;
+#endif
+   if(len == 0)
+      return 0;
+   buf = (char *) malloc(MIN(len, (size_t) COPY_CHUNK_SZ));
+   if(buf == NULL)
+      return -ENOMEM;
+   while(len > 0 && err == 0) {
+      chunk = MIN(len, (size_t) COPY_CHUNK_SZ);
+      err = fatx_devRead(fatx_h, buf, chunk, from);
+      if(err == 0)
+         err = fatx_devWrite(fatx_h, buf, chunk, to);
+      from += chunk;
+      to += chunk;
+      len -= chunk;
+   }
+   free(buf);
+   return err;
+}
+
+int
+fatx_flushClusterCacheEntry(fatx_handle      * fatx_h,
+                            fatx_cache_entry * cacheEntry)
+{
+   off_t fileOffset = cacheEntry->clusterNo;
+   fileOffset *= FAT_CLUSTER_SZ;
+   // Mapped clusters were modified in place.
+   if(cacheEntry->data == cacheEntry->buffer &&
+      fatx_devWrite(fatx_h, cacheEntry->data, FAT_CLUSTER_SZ, fatx_h->dataStart + fileOffset))
+      return -EIO;
+   if(cacheEntry->dirty)
+      __sync_sub_and_fetch(&fatx_h->nDirty, 1);
+   cacheEntry->dirty = 0;
+   return 0;
+}
+
+int 
+fatx_loadCluster(fatx_handle      * fatx_h, 
+                 fatx_cache_entry * cacheEntry,
+                 uint32_t           clusterNo)
+{
+   off_t fileOffset = clusterNo;
+   fileOffset = fatx_h->dataStart + fileOffset * FAT_CLUSTER_SZ;
+   cacheEntry->valid = 0;
+   cacheEntry->dirty = 0;
+   // With a mapped image the entry just points at the mapping.
+   cacheEntry->data = fatx_mapped(fatx_h, fileOffset, FAT_CLUSTER_SZ);
+   if(cacheEntry->data == NULL) {
+      cacheEntry->data = cacheEntry->buffer;
+      if(fatx_devRead(fatx_h, cacheEntry->data, FAT_CLUSTER_SZ, fileOffset))
+         return -EIO;
+   }
+   cacheEntry->clusterNo = clusterNo;
+   cacheEntry->valid = 1;
+   return 0;
+}
+
+fatx_extent_map *
+fatx_getExtentMap(fatx_handle * fatx_h,
+                  uint32_t      firstCluster)
+{
+   fatx_extent_map ** slot = fatx_h->extentCache + (firstCluster % EXTENT_CACHE_SIZE);
+   fatx_extent_map  * map = NULL;
+   uint32_t           clusterNo = firstCluster;
+   uint32_t           i;
+   if(*slot != NULL && (*slot)->firstCluster == firstCluster) {
+      map = *slot;
+      goto finish;
+   }
+   map = (fatx_extent_map *) calloc(1, sizeof(fatx_extent_map));
+   if(map == NULL)
+      goto finish;
+   map->firstCluster = firstCluster;
+   // Walk the chain once. Bound the walk by the cluster count so a looping
+   // chain can't hang us.
+   for(i = 0; i < fatx_h->nClusters; i++) {
+      if(IS_FREE_CLUSTER(clusterNo) || clusterNo >= fatx_h->nClusters)
+         break;
+      // A chain cut short by a FAT page that couldn't be read isn't cached.
+      if(fatx_appendExtent(map, clusterNo, 1) ||
+         fatx_readFatEntry(fatx_h, clusterNo, &clusterNo)) {
+         fatx_freeExtentMap(map);
+         map = NULL;
+         goto finish;
+      }
+   }
+   fatx_freeExtentMap(*slot);
+   *slot = map;
+finish:
+   return map;
+}
+
+uint32_t
+fatx_mapCluster(fatx_handle * fatx_h,
+                uint32_t      firstCluster,
+                uint32_t      fileClusterNo,
+                uint32_t    * runLength)
+{
+   fatx_extent_map * map;
+   fatx_extent     * extent;
+   uint32_t          low = 0, high, mid;
+   uint32_t          clusterNo = 0;
+   pthread_mutex_lock(&fatx_h->extentLock);
+   map = fatx_getExtentMap(fatx_h, firstCluster);
+   if(map == NULL || map->noExtents == 0)
+      goto finish;
+   // Find the last extent starting at or before fileClusterNo.
+   high = map->noExtents;
+   while(high - low > 1) {
+      mid = (low + high) / 2;
+      if(map->extents[mid].fileClusterNo <= fileClusterNo)
+         low = mid;
+      else
+         high = mid;
+   }
+   extent = map->extents + low;
+   if(fileClusterNo - extent->fileClusterNo >= extent->length)
+      goto finish;
+   clusterNo = extent->clusterNo + (fileClusterNo - extent->fileClusterNo);
+   if(runLength != NULL)
+      *runLength = extent->length - (fileClusterNo - extent->fileClusterNo);
+finish:
+   pthread_mutex_unlock(&fatx_h->extentLock);
+   return clusterNo;
+}
+
+
+uint32_t
+fatx_seekCluster(fatx_handle * fatx_h,
+                 uint32_t      firstCluster,
+                 fatx_cursor * cursor,
+                 uint32_t      fileClusterNo,
+                 uint32_t    * runLength)
+{
+   if(cursor != NULL && cursor->clusterNo != 0 && cursor->chainGen == fatx_h->chainGen &&
+      fileClusterNo >= cursor->fileClusterNo &&
+      fileClusterNo - cursor->fileClusterNo < cursor->runLength) {
+      *runLength = cursor->runLength - (fileClusterNo - cursor->fileClusterNo);
+      return cursor->clusterNo + (fileClusterNo - cursor->fileClusterNo);
+   }
+   return fatx_mapCluster(fatx_h, firstCluster, fileClusterNo, runLength);
+}
+
+void
+fatx_setCursor(fatx_handle * fatx_h,
+               fatx_cursor * cursor,
+               uint32_t      fileClusterNo,
+               uint32_t      clusterNo,
+               uint32_t      runLength)
+{
+   if(cursor == NULL)
+      return;
+   cursor->chainGen = fatx_h->chainGen;
+   cursor->fileClusterNo = fileClusterNo;
+   cursor->clusterNo = clusterNo;
+   cursor->runLength = runLength;
+}
+
+void
+fatx_readahead(fatx_handle * fatx_h,
+               uint32_t      firstCluster,
+               uint32_t      fileClusterNo,
+               uint32_t      endClusterNo)
+{
+   fatx_extent_map * map;
+   uint32_t          start, end;
+   pthread_mutex_lock(&fatx_h->extentLock);
+   map = fatx_getExtentMap(fatx_h, firstCluster);
+   if(map == NULL || map->noExtents == 0) {
+      pthread_mutex_unlock(&fatx_h->extentLock);
+      return;
+   }
+   if(fileClusterNo == map->nextRead && fileClusterNo != 0) {
+      map->raWindow = map->raWindow ? MIN(map->raWindow * 2, READAHEAD_MAX) : READAHEAD_MIN;
+   } else {
+      map->raWindow = 0;
+      map->raEnd = 0;
+   }
+   map->nextRead = endClusterNo;
+   // Only hint what earlier read-ahead hasn't already covered.
+   start = MAX(endClusterNo, map->raEnd);
+   end = endClusterNo + map->raWindow;
+   if(map->raWindow == 0 || start >= end) {
+      pthread_mutex_unlock(&fatx_h->extentLock);
+      return;
+   }
+   map->raEnd = end;
+   pthread_mutex_unlock(&fatx_h->extentLock);
+   fatx_prefetchChain(fatx_h, firstCluster, start, end - start);
+}
+
+void
+fatx_prefetchChain(fatx_handle * fatx_h,
+                   uint32_t      firstCluster,
+                   uint32_t      fileClusterNo,
+                   uint32_t      count)
+{
+   fatx_extent_map * map;
+   fatx_extent     * extent;
+   fatx_extent       runs[READAHEAD_MAX_RUNS];
+   uint32_t          noRuns = 0;
+   uint32_t          start = fileClusterNo, end = fileClusterNo + count;
+   uint32_t          skip, i;
+   off_t             fileOffset;
+   pthread_mutex_lock(&fatx_h->extentLock);
+   map = fatx_getExtentMap(fatx_h, firstCluster);
+   for(i = 0; map != NULL && i < map->noExtents && start < end && noRuns < READAHEAD_MAX_RUNS; i++) {
+      extent = map->extents + i;
+      if(extent->fileClusterNo + extent->length <= start)
+         continue;
+      skip = start - extent->fileClusterNo;
+      runs[noRuns].clusterNo = extent->clusterNo + skip;
+      runs[noRuns].length = MIN(extent->length - skip, end - start);
+      start += runs[noRuns].length;
+      noRuns++;
+   }
+   pthread_mutex_unlock(&fatx_h->extentLock);
+   for(i = 0; i < noRuns; i++) {
+      fileOffset = runs[i].clusterNo;
+      fileOffset = fatx_h->dataStart + fileOffset * FAT_CLUSTER_SZ;
+      fatx_adviseRead(fatx_h, fileOffset, (size_t) runs[i].length * FAT_CLUSTER_SZ);
+   }
+}
+
+int
+fatx_appendExtent(fatx_extent_map * map,
+                  uint32_t          clusterNo,
+                  uint32_t          length)
+{
+   fatx_extent * last = map->noExtents ? map->extents + map->noExtents - 1 : NULL;
+   fatx_extent * extents;
+   uint32_t      fileClusterNo = last ? last->fileClusterNo + last->length : 0;
+   if(last != NULL && last->clusterNo + last->length == clusterNo) {
+      last->length += length;
+      return 0;
+   }
+   if(map->noExtents == map->maxExtents) {
+      extents = (fatx_extent *) realloc(map->extents,
+                                        MAX(4, map->maxExtents * 2) * sizeof(fatx_extent));
+      if(extents == NULL)
+         return -1;
+      map->extents = extents;
+      map->maxExtents = MAX(4, map->maxExtents * 2);
+   }
+   map->extents[map->noExtents].fileClusterNo = fileClusterNo;
+   map->extents[map->noExtents].clusterNo = clusterNo;
+   map->extents[map->noExtents].length = length;
+   map->noExtents++;
+   return 0;
+}
+
+void
+fatx_extendExtentMap(fatx_handle * fatx_h,
+                     uint32_t      firstCluster,
+                     uint32_t      clusterNo,
+                     uint32_t      length)
+{
+   fatx_extent_map ** slot = fatx_h->extentCache + (firstCluster % EXTENT_CACHE_SIZE);
+   pthread_mutex_lock(&fatx_h->extentLock);
+   if(*slot != NULL && (*slot)->firstCluster == firstCluster) {
+      if(fatx_appendExtent(*slot, clusterNo, length)) {
+         fatx_freeExtentMap(*slot);
+         *slot = NULL;
+      }
+   }
+   pthread_mutex_unlock(&fatx_h->extentLock);
+}
+
+void
+fatx_invalidateExtentMap(fatx_handle * fatx_h,
+                         uint32_t      firstCluster)
+{
+   fatx_extent_map ** slot = fatx_h->extentCache + (firstCluster % EXTENT_CACHE_SIZE);
+   pthread_mutex_lock(&fatx_h->extentLock);
+   if(*slot != NULL && (*slot)->firstCluster == firstCluster) {
+      fatx_freeExtentMap(*slot);
+      *slot = NULL;
+   }
+   pthread_mutex_unlock(&fatx_h->extentLock);
+}
+
+void
+fatx_markClusterDirty(fatx_handle      * fatx_h,
+                      fatx_cache_entry * cacheEntry)
+{
+   if(!cacheEntry->dirty) {
+      cacheEntry->dirty = 1;
+      if(__sync_add_and_fetch(&fatx_h->nDirty, 1) >= fatx_h->dirtyThreshold &&
+         fatx_h->flusherRunning) {
+         // The flusher only waits with flushLock held and nothing wanted, so
+         // the request can't be lost while it is busy.
+         pthread_mutex_lock(&fatx_h->flushLock);
+         fatx_h->flushWanted = 1;
+         pthread_cond_signal(&fatx_h->flushCond);
+         pthread_mutex_unlock(&fatx_h->flushLock);
+      }
+   }
+   fatx_noteDirty(fatx_h);
+}
+
+void
+fatx_noteDirty(fatx_handle * fatx_h)
+{
+   if(fatx_h->dirtySince == 0)
+      fatx_h->dirtySince = time(NULL);
+}
+
+int
+fatx_writeVector(fatx_handle  * fatx_h,
+                 struct iovec * iov,
+                 int            iovcnt,
+                 off_t          offset)
+{
+   ssize_t written;
+   while(iovcnt > 0) {
+      written = pwritev(fatx_h->dev, iov, iovcnt, offset);
+      if(written < 0 && errno == EINTR)
+         continue;
+      if(written <= 0)
+         return -EIO;
+      offset += written;
+      // Skip past the buffers that were written completely.
+      while(iovcnt > 0 && (size_t) written >= iov->iov_len) {
+         written -= iov->iov_len;
+         iov++;
+         iovcnt--;
+      }
+      if(iovcnt > 0) {
+         iov->iov_base = (char *) iov->iov_base + written;
+         iov->iov_len -= written;
+      }
+   }
+   return 0;
+}
+
+int
+fatx_compareClusterEntries(const void * a,
+                           const void * b)
+{
+   uint32_t x = (*(fatx_cache_entry * const *) a)->clusterNo;
+   uint32_t y = (*(fatx_cache_entry * const *) b)->clusterNo;
+   return (x > y) - (x < y);
+}
+
+int
+fatx_compareFatEntries(const void * a,
+                       const void * b)
+{
+   uint32_t x = (*(fatx_fat_cache_entry * const *) a)->pageNo;
+   uint32_t y = (*(fatx_fat_cache_entry * const *) b)->pageNo;
+   return (x > y) - (x < y);
+}
+
+int
+fatx_compareExtents(const void * a,
+                    const void * b)
+{
+   uint32_t x = ((const fatx_extent *) a)->clusterNo;
+   uint32_t y = ((const fatx_extent *) b)->clusterNo;
+   return (x > y) - (x < y);
+}
+
+int
+fatx_flush(fatx_handle * fatx_h)
+{
+   uint32_t               nEntries = fatx_h->cacheSets * CACHE_WAYS;
+   fatx_cache_entry    ** dirty = NULL;
+   fatx_fat_cache_entry * dirtyPages[FAT_CACHE_SIZE];
+   struct iovec           iov[FLUSH_MAX_IOV];
+   uint32_t               noDirty = 0, i, j, k;
+   off_t                  offset;
+   int                    err = 0, fatErr;
+   pthread_mutex_lock(&fatx_h->flushLock);
+   dirty = (fatx_cache_entry **) malloc(nEntries * sizeof(fatx_cache_entry *));
+   if(dirty == NULL) {
+      err = -ENOMEM;
+      goto finish;
+   }
+   // Pin the dirty clusters so concurrent readers can't evict them mid flush.
+   for(i = 0; i < nEntries; i++) {
+      if(i % CACHE_WAYS == 0)
+         pthread_mutex_lock(&fatx_h->sets[i / CACHE_WAYS].lock);
+      if(fatx_h->cache[i].valid && fatx_h->cache[i].dirty) {
+         if(fatx_h->cache[i].data != fatx_h->cache[i].buffer) {
+            // Mapped clusters were modified in place, msync covers them.
+            fatx_h->cache[i].dirty = 0;
+            __sync_sub_and_fetch(&fatx_h->nDirty, 1);
+         } else {
+            fatx_h->cache[i].refCount++;
+            dirty[noDirty++] = fatx_h->cache + i;
+         }
+      }
+      if(i % CACHE_WAYS == CACHE_WAYS - 1)
+         pthread_mutex_unlock(&fatx_h->sets[i / CACHE_WAYS].lock);
+   }
+   qsort(dirty, noDirty, sizeof(fatx_cache_entry *), fatx_compareClusterEntries);
+   for(i = 0; i < noDirty; i = j) {
+      for(j = i; j < noDirty && j - i < FLUSH_MAX_IOV &&
+                 dirty[j]->clusterNo == dirty[i]->clusterNo + (j - i); j++) {
+         iov[j - i].iov_base = dirty[j]->data;
+         iov[j - i].iov_len = FAT_CLUSTER_SZ;
+      }
+      offset = dirty[i]->clusterNo;
+      offset = fatx_h->dataStart + offset * FAT_CLUSTER_SZ;
+      if(fatx_writeVector(fatx_h, iov, j - i, offset)) {
+         err = -EIO;
+         continue;
+      }
+      for(k = i; k < j; k++)
+         dirty[k]->dirty = 0;
+      __sync_sub_and_fetch(&fatx_h->nDirty, j - i);
+   }
+   for(i = 0; i < noDirty; i++)
+      fatx_releaseCluster(fatx_h, dirty[i]);
+   // Same again for the FAT page cache.
+   pthread_mutex_lock(&fatx_h->fatLock);
+   noDirty = 0;
+   for(i = 0; i < FAT_CACHE_SIZE; i++) {
+      if(fatx_h->fatCache[i].dirty)
+         dirtyPages[noDirty++] = fatx_h->fatCache + i;
+   }
+   qsort(dirtyPages, noDirty, sizeof(fatx_fat_cache_entry *), fatx_compareFatEntries);
+   for(i = 0; i < noDirty; i = j) {
+      for(j = i; j < noDirty && j - i < FLUSH_MAX_IOV &&
+                 dirtyPages[j]->pageNo == dirtyPages[i]->pageNo + (j - i); j++) {
+         iov[j - i].iov_base = dirtyPages[j]->data;
+         iov[j - i].iov_len = FAT_PAGE_SZ;
+      }
+      offset = dirtyPages[i]->pageNo;
+      offset = FAT_OFFSET + offset * FAT_PAGE_SZ;
+      if(fatx_writeVector(fatx_h, iov, j - i, offset)) {
+         err = -EIO;
+         continue;
+      }
+      for(k = i; k < j; k++)
+         dirtyPages[k]->dirty = 0;
+   }
+   if(fatx_h->fat != NULL) {
+      fatErr = fatx_flushResidentFat(fatx_h);
+      if(err == 0)
+         err = fatErr;
+   }
+   pthread_mutex_unlock(&fatx_h->fatLock);
+   if(fatx_h->map != NULL && msync(fatx_h->map, fatx_h->mapSize, MS_SYNC))
+      err = -EIO;
+   if(err == 0)
+      fatx_h->dirtySince = 0;
+finish:
+   free(dirty);
+   pthread_mutex_unlock(&fatx_h->flushLock);
+   return err;
+}
+
+void *
+fatx_flusherMain(void * arg)
+{
+   fatx_handle   * fatx_h = (fatx_handle *) arg;
+   struct timespec deadline;
+   char            due;
+   pthread_mutex_lock(&fatx_h->flushLock);
+   while(!fatx_h->flusherStop) {
+      if(!fatx_h->flushWanted) {
+         clock_gettime(CLOCK_REALTIME, &deadline);
+         deadline.tv_sec += fatx_h->options.flushInterval;
+         pthread_cond_timedwait(&fatx_h->flushCond, &fatx_h->flushLock, &deadline);
+      }
+      fatx_h->flushWanted = 0;
+      if(fatx_h->flusherStop)
+         break;
+      pthread_mutex_unlock(&fatx_h->flushLock);
+      // Writers are excluded while the shared lock is held, so the dirty
+      // state can't change under us.
+      FATX_RDLOCK(fatx_h);
+      due = __sync_add_and_fetch(&fatx_h->nDirty, 0) >= fatx_h->dirtyThreshold ||
+            (fatx_h->dirtySince != 0 &&
+             time(NULL) - fatx_h->dirtySince >= (time_t) fatx_h->options.flushInterval);
+      if(due)
+         fatx_flush(fatx_h);
+      FATX_UNLOCK(fatx_h);
+      pthread_mutex_lock(&fatx_h->flushLock);
+   }
+   pthread_mutex_unlock(&fatx_h->flushLock);
+   return NULL;
+}
+
+void
+fatx_freeExtentMap(fatx_extent_map * map)
+{
+   if(map == NULL)
+      return;
+   free(map->extents);
+   free(map);
+}
+
+void
+fatx_initPathIter(fatx_path_iter * iter,
+                  const char     * path,
+                  size_t           pathLen)
+{
+   iter->pos = path;
+   iter->end = path + pathLen;
+   iter->name = NULL;
+   iter->nameLen = 0;
+}
+
+int
+fatx_nextPathComponent(fatx_path_iter * iter)
+{
+   // Skip leading /'s
+   while(iter->pos < iter->end && *iter->pos == '/')
+      iter->pos++;
+   if(iter->pos == iter->end)
+      return 0;
+   iter->name = iter->pos;
+   while(iter->pos < iter->end && *iter->pos != '/')
+      iter->pos++;
+   iter->nameLen = iter->pos - iter->name;
+   if(iter->nameLen > FATX_MAX_NAME_LEN)
+      return -ENAMETOOLONG;
+   return 1;
+}
+
+int
+fatx_splitPath(const char  * path,
+               size_t      * dirLen,
+               const char ** basename,
+               size_t      * baseLen)
+{
+   fatx_path_iter iter;
+   int            err = 0;
+   *dirLen = 0;
+   *basename = NULL;
+   *baseLen = 0;
+   if(path == NULL)
+      return 0;
+   fatx_initPathIter(&iter, path, strlen(path));
+   while( (err = fatx_nextPathComponent(&iter)) > 0) {
+      if(*basename != NULL)
+         *dirLen = *basename + *baseLen - path;
+      *basename = iter.name;
+      *baseLen = iter.nameLen;
+   }
+   return err;
+}
+
+fatx_dir_iter *
+fatx_createDirIter(fatx_handle *          fatx_h,
+                   fatx_directory_entry * directoryEntry)
+{
+   fatx_dir_iter * iter = (fatx_dir_iter *) malloc(sizeof(fatx_dir_iter));
+   if(iter != NULL && fatx_initDirIter(fatx_h, iter, directoryEntry)) {
+      free(iter);
+      iter = NULL;
+   }
+   return iter;
+}
+
+int
+fatx_initDirIter(fatx_handle *          fatx_h,
+                 fatx_dir_iter *        iter,
+                 fatx_directory_entry * directoryEntry)
+{
+   uint32_t clusterNo = 1;
+   if (directoryEntry != NULL) {
+      if(!IS_VALID_ENTRY(directoryEntry) || !IS_FOLDER(directoryEntry))
+         return -ENOTDIR;
+      clusterNo = SWAP32(directoryEntry->firstCluster);
+   } 
+   iter->fatx_h = fatx_h;
+   iter->entryNo = 0;
+   iter->clusterNo = clusterNo;
+   iter->dirEntList = NULL;
+   iter->err = 0;
+   return 0;
+}
+
+fatx_directory_entry *
+fatx_readDirectoryEntry(fatx_handle *   fatx_h,
+                        fatx_dir_iter * iter)
+{
+   fatx_directory_entry   * directoryEntry = NULL;
+   fatx_cache_entry       * cacheEntry;
+   uint32_t                 nextCluster;
+   if(iter->entryNo == DIR_ENTRIES_PER_CLUSTER) {
+      if(fatx_readFatEntry(fatx_h, iter->clusterNo, &nextCluster)) {
+         iter->err = -EIO;
+         return NULL;
+      }
+      if (fatx_isEOC(fatx_h, nextCluster) || IS_FREE_CLUSTER(nextCluster)) return NULL;
+      iter->entryNo = 0;
+      iter->clusterNo = nextCluster;
+   }
+   cacheEntry = fatx_getCluster(fatx_h, iter->clusterNo);
+   if(cacheEntry == NULL) {
+      iter->err = -EIO;
+      return NULL;
+   }
+   if(cacheEntry->dirEntries[iter->entryNo].filenameSz != 0xFF) {
+      iter->entry = cacheEntry->dirEntries[iter->entryNo];
+      iter->loc.clusterNo = iter->clusterNo;
+      iter->loc.entryNo = iter->entryNo;
+      directoryEntry = &iter->entry;
+      iter->entryNo++;
+   }
+   fatx_releaseCluster(fatx_h, cacheEntry);
+   return directoryEntry;
+}
+
+fatx_directory_entry *
+fatx_scanDirectory(fatx_handle *   fatx_h,
+                   fatx_dir_iter * iter,
+                   const char *    name,
+                   size_t          nameLen)
+{
+   fatx_directory_entry   * directoryEntry;
+   fatx_cache_entry       * cacheEntry;
+   uint32_t                 nextCluster, i;
+   for(;;) {
+      if(iter->entryNo == DIR_ENTRIES_PER_CLUSTER) {
+         if(fatx_readFatEntry(fatx_h, iter->clusterNo, &nextCluster)) {
+            iter->err = -EIO;
+            return NULL;
+         }
+         if (fatx_isEOC(fatx_h, nextCluster) || IS_FREE_CLUSTER(nextCluster)) return NULL;
+         iter->entryNo = 0;
+         iter->clusterNo = nextCluster;
+      }
+      cacheEntry = fatx_getCluster(fatx_h, iter->clusterNo);
+      if(cacheEntry == NULL) {
+         iter->err = -EIO;
+         return NULL;
+      }
+      for(i = iter->entryNo; i < DIR_ENTRIES_PER_CLUSTER; i++) {
+         i = name ? fatx_scanName(fatx_h, cacheEntry->dirEntries, i, name, nameLen) :
+                    fatx_scanValid(fatx_h, cacheEntry->dirEntries, i);
+         if(i == DIR_ENTRIES_PER_CLUSTER)
+            break;
+         directoryEntry = cacheEntry->dirEntries + i;
+         if(directoryEntry->filenameSz == 0xFF) {
+            // Stay on the end marker, like fatx_readDirectoryEntry.
+            iter->entryNo = i;
+            fatx_releaseCluster(fatx_h, cacheEntry);
+            return NULL;
+         }
+         if(name == NULL || fatx_nameMatches(directoryEntry, name, nameLen)) {
+            iter->entry = *directoryEntry;
+            iter->loc.clusterNo = iter->clusterNo;
+            iter->loc.entryNo = i;
+            iter->entryNo = i + 1;
+            fatx_releaseCluster(fatx_h, cacheEntry);
+            return &iter->entry;
+         }
+      }
+      fatx_releaseCluster(fatx_h, cacheEntry);
+      iter->entryNo = DIR_ENTRIES_PER_CLUSTER;
+   }
+}
+
+void
+fatx_fillDirentPlus(fatx_handle *          fatx_h,
+                    fatx_directory_entry * directoryEntry,
+                    fatx_dirent_plus_t *   entry)
+{
+   entry->d_namelen = directoryEntry->filenameSz;
+   memcpy(entry->d_name, directoryEntry->filename, entry->d_namelen);
+   entry->d_name[entry->d_namelen] = '\0';
+   entry->mode = IS_FOLDER(directoryEntry) ? S_IFDIR : S_IFREG;
+   entry->mode |= fatx_h->options.filePerm;
+   entry->attributes = directoryEntry->attributes;
+   entry->size = SWAP32(directoryEntry->fileSize);
+   entry->firstCluster = SWAP32(directoryEntry->firstCluster);
+   entry->mtime = fatx_makeTimeType(SWAP16(directoryEntry->modificationDate),
+                                    SWAP16(directoryEntry->modificationTime));
+   entry->atime = fatx_makeTimeType(SWAP16(directoryEntry->accessDate),
+                                    SWAP16(directoryEntry->accessTime));
+   entry->ctime = fatx_makeTimeType(SWAP16(directoryEntry->creationDate),
+                                    SWAP16(directoryEntry->creationTime));
+}
+
+int
+fatx_findDirectoryEntry(fatx_handle *          fatx_h,
+                        const char *           path,
+                        size_t                 pathLen,
+                        fatx_directory_entry * baseDirectoryEntry,
+                        fatx_directory_entry * result,
+                        fatx_dirent_loc *      loc)
+{
+   fatx_dir_iter          iter;
+   fatx_path_iter         pathIter;
+   fatx_directory_entry * directoryEntry = NULL;
+   uint32_t               parentCluster;
+   const char           * name;
+   size_t                 nameLen;
+   int                    err;
+   *result = baseDirectoryEntry ? *baseDirectoryEntry : fatx_h->rootDirEntry;
+   if (baseDirectoryEntry == NULL) {
+      loc->clusterNo = 0;
+      loc->entryNo = 0;
+   }
+   fatx_initPathIter(&pathIter, path, pathLen);
+   while( (err = fatx_nextPathComponent(&pathIter)) > 0) {
+      if(fatx_initDirIter(fatx_h, &iter, result))
+         return -ENOTDIR;
+      parentCluster = iter.clusterNo;
+      name = pathIter.name;
+      nameLen = pathIter.nameLen;
+      err = fatx_dcacheLookup(fatx_h, parentCluster, name, nameLen, result, loc);
+      if(err == 0)
+         continue;
+      if(err < 0)
+         return err;
+      err = fatx_dirBloomLookup(fatx_h, result, name, nameLen);
+      if(err == -ENOENT) {
+         fatx_dcacheInsert(fatx_h, parentCluster, name, nameLen, NULL);
+         return err;
+      }
+      err = fatx_dirIndexLookup(fatx_h, result, name, nameLen, result, loc);
+      if(err == 0) {
+         fatx_dcacheInsert(fatx_h, parentCluster, name, nameLen, loc);
+         continue;
+      }
+      if(err == -ENOENT) {
+         fatx_dcacheInsert(fatx_h, parentCluster, name, nameLen, NULL);
+         return err;
+      }
+      if(err < 0)
+         return err;
+      // No index for this directory, scan it.
+      directoryEntry = fatx_scanDirectory(fatx_h, &iter, name, nameLen);
+      if(directoryEntry == NULL && iter.err)
+         return iter.err;
+      if(directoryEntry == NULL) {
+         fatx_dcacheInsert(fatx_h, parentCluster, name, nameLen, NULL);
+         return -ENOENT;
+      }
+      fatx_dcacheInsert(fatx_h, parentCluster, name, nameLen, &iter.loc);
+      *result = *directoryEntry;
+      *loc = iter.loc;
+   }
+   return err;
+}
+
+int
+fatx_nameMatches(fatx_directory_entry * directoryEntry,
+                 const char           * name,
+                 size_t                 nameLen)
+{
+   return directoryEntry->filenameSz == nameLen &&
+          !memcmp(directoryEntry->filename, name, nameLen);
+}
+
+uint32_t
+fatx_hashName(const char * name,
+              size_t       nameLen)
+{
+   uint32_t hash = 2166136261U;
+   size_t   i;
+   for(i = 0; i < nameLen; i++) {
+      hash ^= (uint8_t) name[i];
+      hash *= 16777619U;
+   }
+   return hash;
+}
+
+uint32_t
+fatx_dcacheHash(uint32_t     parentCluster,
+                const char * name,
+                size_t       nameLen)
+{
+   return (fatx_hashName(name, nameLen) ^ (parentCluster * 2654435761U)) % DCACHE_SIZE;
+}
+
+int
+fatx_dcacheLookup(fatx_handle          * fatx_h,
+                  uint32_t               parentCluster,
+                  const char           * name,
+                  size_t                 nameLen,
+                  fatx_directory_entry * result,
+                  fatx_dirent_loc      * loc)
+{
+   fatx_dcache_entry * slot = fatx_h->dcache + fatx_dcacheHash(parentCluster, name, nameLen);
+   fatx_dirent_loc     found;
+   fatx_cache_entry  * cacheEntry;
+   int                 err = 1;
+   pthread_mutex_lock(&fatx_h->dcacheLock);
+   if(slot->parentCluster == parentCluster && slot->nameLen == nameLen &&
+      !memcmp(slot->name, name, nameLen)) {
+      err = slot->negative ? -ENOENT : 0;
+      found = slot->loc;
+   }
+   pthread_mutex_unlock(&fatx_h->dcacheLock);
+   if(err != 0)
+      return err;
+   cacheEntry = fatx_getCluster(fatx_h, found.clusterNo);
+   if(cacheEntry == NULL)
+      return -EIO;
+   if(IS_VALID_ENTRY(cacheEntry->dirEntries + found.entryNo) &&
+      fatx_nameMatches(cacheEntry->dirEntries + found.entryNo, name, nameLen)) {
+      *result = cacheEntry->dirEntries[found.entryNo];
+      *loc = found;
+   } else {
+      err = 1;
+   }
+   fatx_releaseCluster(fatx_h, cacheEntry);
+   return err;
+}
+
+void
+fatx_dcacheInsert(fatx_handle     * fatx_h,
+                  uint32_t          parentCluster,
+                  const char      * name,
+                  size_t            nameLen,
+                  fatx_dirent_loc * loc)
+{
+   fatx_dcache_entry * slot = fatx_h->dcache + fatx_dcacheHash(parentCluster, name, nameLen);
+   if(nameLen > sizeof(slot->name))
+      return;
+   pthread_mutex_lock(&fatx_h->dcacheLock);
+   slot->parentCluster = parentCluster;
+   slot->nameLen = nameLen;
+   memcpy(slot->name, name, nameLen);
+   slot->negative = loc == NULL;
+   if(loc != NULL)
+      slot->loc = *loc;
+   pthread_mutex_unlock(&fatx_h->dcacheLock);
+}
+
+void
+fatx_dcachePurgeDir(fatx_handle * fatx_h,
+                    uint32_t      parentCluster)
+{
+   uint32_t i;
+   pthread_mutex_lock(&fatx_h->dcacheLock);
+   for(i = 0; i < DCACHE_SIZE; i++) {
+      if(fatx_h->dcache[i].parentCluster == parentCluster)
+         fatx_h->dcache[i].parentCluster = 0;
+   }
+   pthread_mutex_unlock(&fatx_h->dcacheLock);
+}
+
+
+fatx_dir_index *
+fatx_getDirIndex(fatx_handle          * fatx_h,
+                 fatx_directory_entry * folder)
+{
+   fatx_dir_index       * index = NULL;
+   fatx_directory_entry * directoryEntry;
+   fatx_dir_iter          iter;
+   uint32_t               firstCluster = SWAP32(folder->firstCluster);
+   uint32_t               i, lru, unused;
+   for(i = 0; i < DIR_INDEX_CACHE_SIZE; i++) {
+      if(fatx_h->dirIndexes[i] != NULL && fatx_h->dirIndexes[i]->firstCluster == firstCluster) {
+         index = fatx_h->dirIndexes[i];
+         goto finish;
+      }
+   }
+   // A directory too big for the budget is read again only to rebuild its
+   // Bloom filter.
+   if((firstCluster == fatx_h->dirIndexRejected && fatx_findDirBloom(fatx_h, firstCluster)) ||
+      fatx_initDirIter(fatx_h, &iter, folder))
+      return NULL;
+   index = (fatx_dir_index *) calloc(1, sizeof(fatx_dir_index));
+   if(index == NULL)
+      return NULL;
+   index->firstCluster = firstCluster;
+   while( (directoryEntry = fatx_readDirectoryEntry(fatx_h, &iter)) ) {
+      if(!IS_VALID_ENTRY(directoryEntry)) {
+         if(fatx_dirIndexAddFreeSlot(fatx_h, index, &iter.loc))
+            goto error;
+         continue;
+      }
+      if(fatx_dirIndexAdd(fatx_h, index, fatx_hashName(directoryEntry->filename,
+                                                       directoryEntry->filenameSz),
+                          &iter.loc))
+         goto error;
+   }
+   if(iter.err)
+      goto error;
+   // The iterator stopped on the end of directory marker or past the end
+   // of the last cluster.
+   index->end.clusterNo = iter.clusterNo;
+   index->end.entryNo = iter.entryNo;
+   if(index->slots == NULL && fatx_dirIndexAdd(fatx_h, index, 0, NULL))
+      goto error;
+   // Evict least recently used indexes until the new one fits and has a
+   // slot of its own.
+   for(;;) {
+      lru = DIR_INDEX_CACHE_SIZE;
+      unused = DIR_INDEX_CACHE_SIZE;
+      for(i = 0; i < DIR_INDEX_CACHE_SIZE; i++) {
+         if(fatx_h->dirIndexes[i] == NULL)
+            unused = i;
+         else if(lru == DIR_INDEX_CACHE_SIZE ||
+                 fatx_h->dirIndexes[i]->lastUsed < fatx_h->dirIndexes[lru]->lastUsed)
+            lru = i;
+      }
+      if(unused < DIR_INDEX_CACHE_SIZE && fatx_h->dirIndexMem <= fatx_h->dirIndexBudget)
+         break;
+      if(lru == DIR_INDEX_CACHE_SIZE) {
+         // Too big for the budget on its own. Don't build it again on
+         // every lookup; the complete scan still gives a Bloom filter.
+         fatx_h->dirIndexRejected = firstCluster;
+         fatx_dirBloomFromIndex(fatx_h, index);
+         goto error;
+      }
+      fatx_dirIndexDrop(fatx_h, fatx_h->dirIndexes[lru]->firstCluster);
+   }
+   fatx_h->dirIndexes[unused] = index;
+   fatx_dirBloomFromIndex(fatx_h, index);
+finish:
+   index->lastUsed = ++fatx_h->dirIndexClock;
+   return index;
+error:
+   fatx_h->dirIndexMem -= fatx_dirIndexSize(index);
+   fatx_freeDirIndex(index);
+   return NULL;
+}
+
+int
+fatx_dirIndexAdd(fatx_handle         * fatx_h,
+                 fatx_dir_index      * index,
+                 uint32_t              hash,
+                 fatx_dirent_loc     * loc)
+{
+   fatx_dir_index_slot * slots;
+   uint32_t              noSlots, i, j;
+   // Keep the table at most half full, counting deleted slots.
+   if(index->slots == NULL || (index->noUsed + index->noDeleted + 1) * 2 > index->noSlots) {
+      noSlots = DIR_INDEX_MIN_SLOTS;
+      while(noSlots < (index->noUsed + 1) * 4)
+         noSlots *= 2;
+      slots = (fatx_dir_index_slot *) calloc(noSlots, sizeof(fatx_dir_index_slot));
+      if(slots == NULL)
+         return -ENOMEM;
+      for(i = 0; i < index->noSlots; i++) {
+         if(index->slots[i].state != 1)
+            continue;
+         for(j = index->slots[i].hash & (noSlots - 1); slots[j].state; j = (j + 1) & (noSlots - 1));
+         slots[j] = index->slots[i];
+      }
+      fatx_h->dirIndexMem += noSlots * sizeof(fatx_dir_index_slot);
+      fatx_h->dirIndexMem -= index->noSlots * sizeof(fatx_dir_index_slot);
+      free(index->slots);
+      index->slots = slots;
+      index->noSlots = noSlots;
+      index->noDeleted = 0;
+   }
+   if(loc == NULL)
+      return 0;
+   for(i = hash & (index->noSlots - 1); index->slots[i].state == 1; i = (i + 1) & (index->noSlots - 1));
+   if(index->slots[i].state == 2)
+      index->noDeleted--;
+   index->slots[i].hash = hash;
+   index->slots[i].clusterNo = loc->clusterNo;
+   index->slots[i].entryNo = loc->entryNo;
+   index->slots[i].state = 1;
+   index->noUsed++;
+   return 0;
+}
+
+int
+fatx_dirIndexAddFreeSlot(fatx_handle     * fatx_h,
+                         fatx_dir_index  * index,
+                         fatx_dirent_loc * loc)
+{
+   fatx_dirent_loc * freeSlots;
+   uint32_t          maxFreeSlots;
+   if(index->noFreeSlots == index->maxFreeSlots) {
+      maxFreeSlots = index->maxFreeSlots ? index->maxFreeSlots * 2 : DIR_ENTRIES_PER_CLUSTER;
+      freeSlots = (fatx_dirent_loc *) realloc(index->freeSlots,
+                                              maxFreeSlots * sizeof(fatx_dirent_loc));
+      if(freeSlots == NULL)
+         return -ENOMEM;
+      fatx_h->dirIndexMem += (maxFreeSlots - index->maxFreeSlots) * sizeof(fatx_dirent_loc);
+      index->freeSlots = freeSlots;
+      index->maxFreeSlots = maxFreeSlots;
+   }
+   index->freeSlots[index->noFreeSlots++] = *loc;
+   return 0;
+}
+
+size_t
+fatx_dirIndexSize(fatx_dir_index * index)
+{
+   return index->noSlots * sizeof(fatx_dir_index_slot) +
+          index->maxFreeSlots * sizeof(fatx_dirent_loc);
+}
+
+int
+fatx_dirIndexLookup(fatx_handle          * fatx_h,
+                    fatx_directory_entry * folder,
+                    const char           * name,
+                    size_t                 nameLen,
+                    fatx_directory_entry * result,
+                    fatx_dirent_loc      * loc)
+{
+   fatx_dir_index      * index;
+   fatx_dir_index_slot * slot;
+   fatx_cache_entry    * cacheEntry;
+   uint32_t              hash = fatx_hashName(name, nameLen);
+   uint32_t              i;
+   int                   err = -ENOENT;
+   pthread_mutex_lock(&fatx_h->dirIndexLock);
+   index = fatx_getDirIndex(fatx_h, folder);
+   if(index == NULL) {
+      err = 1;
+      goto finish;
+   }
+   for(i = hash & (index->noSlots - 1); index->slots[i].state; i = (i + 1) & (index->noSlots - 1)) {
+      slot = index->slots + i;
+      if(slot->state != 1 || slot->hash != hash)
+         continue;
+      cacheEntry = fatx_getCluster(fatx_h, slot->clusterNo);
+      if(cacheEntry == NULL) {
+         err = -EIO;
+         break;
+      }
+      if(IS_VALID_ENTRY(cacheEntry->dirEntries + slot->entryNo) &&
+         fatx_nameMatches(cacheEntry->dirEntries + slot->entryNo, name, nameLen)) {
+         *result = cacheEntry->dirEntries[slot->entryNo];
+         loc->clusterNo = slot->clusterNo;
+         loc->entryNo = slot->entryNo;
+         err = 0;
+      }
+      fatx_releaseCluster(fatx_h, cacheEntry);
+      if(err == 0)
+         break;
+   }
+finish:
+   pthread_mutex_unlock(&fatx_h->dirIndexLock);
+   return err;
+}
+
+void
+fatx_dirIndexInsert(fatx_handle     * fatx_h,
+                    uint32_t          parentCluster,
+                    const char      * name,
+                    size_t            nameLen,
+                    fatx_dirent_loc * loc)
+{
+   fatx_dir_index * index;
+   uint32_t         i, j;
+   pthread_mutex_lock(&fatx_h->dirIndexLock);
+   for(i = 0; i < DIR_INDEX_CACHE_SIZE; i++) {
+      index = fatx_h->dirIndexes[i];
+      if(index == NULL || index->firstCluster != parentCluster)
+         continue;
+      if(loc->clusterNo == index->end.clusterNo && loc->entryNo == index->end.entryNo) {
+         index->end.entryNo++;
+      } else {
+         // Free slots are handed out from the back of the list.
+         for(j = index->noFreeSlots; j > 0; j--) {
+            if(index->freeSlots[j - 1].clusterNo == loc->clusterNo &&
+               index->freeSlots[j - 1].entryNo == loc->entryNo) {
+               index->freeSlots[j - 1] = index->freeSlots[--index->noFreeSlots];
+               break;
+            }
+         }
+      }
+      if(fatx_dirIndexAdd(fatx_h, index, fatx_hashName(name, nameLen), loc))
+         fatx_dirIndexDrop(fatx_h, parentCluster);
+      break;
+   }
+   fatx_dirBloomAdd(fatx_h, parentCluster, fatx_hashName(name, nameLen));
+   pthread_mutex_unlock(&fatx_h->dirIndexLock);
+}
+void
+fatx_dirIndexRemove(fatx_handle     * fatx_h,
+                    uint32_t          parentCluster,
+                    const char      * name,
+                    size_t            nameLen,
+                    fatx_dirent_loc * loc)
+{
+   fatx_dir_index * index = NULL;
+   uint32_t         hash = fatx_hashName(name, nameLen);
+   uint32_t         i;
+   pthread_mutex_lock(&fatx_h->dirIndexLock);
+   for(i = 0; i < DIR_INDEX_CACHE_SIZE; i++) {
+      if(fatx_h->dirIndexes[i] != NULL && fatx_h->dirIndexes[i]->firstCluster == parentCluster) {
+         index = fatx_h->dirIndexes[i];
+         break;
+      }
+   }
+   if(index == NULL)
+      goto finish;
+   for(i = hash & (index->noSlots - 1); index->slots[i].state; i = (i + 1) & (index->noSlots - 1)) {
+      if(index->slots[i].state == 1 && index->slots[i].clusterNo == loc->clusterNo &&
+         index->slots[i].entryNo == loc->entryNo) {
+         index->slots[i].state = 2;
+         index->noUsed--;
+         index->noDeleted++;
+         if(fatx_dirIndexAddFreeSlot(fatx_h, index, loc))
+            fatx_dirIndexDrop(fatx_h, parentCluster);
+         break;
+      }
+   }
+finish:
+   pthread_mutex_unlock(&fatx_h->dirIndexLock);
+}
+
+void
+fatx_dirIndexDrop(fatx_handle * fatx_h,
+                  uint32_t      parentCluster)
+{
+   uint32_t i;
+   for(i = 0; i < DIR_INDEX_CACHE_SIZE; i++) {
+      if(fatx_h->dirIndexes[i] != NULL && fatx_h->dirIndexes[i]->firstCluster == parentCluster) {
+         fatx_h->dirIndexMem -= fatx_dirIndexSize(fatx_h->dirIndexes[i]);
+         fatx_freeDirIndex(fatx_h->dirIndexes[i]);
+         fatx_h->dirIndexes[i] = NULL;
+      }
+   }
+}
+
+void
+fatx_freeDirIndex(fatx_dir_index * index)
+{
+   if(index == NULL)
+      return;
+   free(index->slots);
+   free(index->freeSlots);
+   free(index);
+}
+
+fatx_dir_bloom *
+fatx_findDirBloom(fatx_handle * fatx_h,
+                  uint32_t      firstCluster)
+{
+   uint32_t i;
+   for(i = 0; i < DIR_BLOOM_CACHE_SIZE; i++) {
+      if(fatx_h->dirBlooms[i] != NULL && fatx_h->dirBlooms[i]->firstCluster == firstCluster) {
+         fatx_h->dirBlooms[i]->lastUsed = ++fatx_h->dirIndexClock;
+         return fatx_h->dirBlooms[i];
+      }
+   }
+   return NULL;
+}
+
+fatx_dir_bloom *
+fatx_newDirBloom(fatx_handle * fatx_h,
+                 uint32_t      firstCluster,
+                 uint32_t      noNames)
+{
+   fatx_dir_bloom * bloom;
+   uint32_t         noBits = 64, i, lru = 0;
+   noNames = MAX(noNames, DIR_BLOOM_MIN_NAMES);
+   while(noBits < noNames * DIR_BLOOM_BITS_PER_NAME)
+      noBits *= 2;
+   bloom = (fatx_dir_bloom *) calloc(1, sizeof(fatx_dir_bloom));
+   if(bloom == NULL)
+      return NULL;
+   bloom->bits = (uint64_t *) calloc(noBits / 64, sizeof(uint64_t));
+   if(bloom->bits == NULL) {
+      free(bloom);
+      return NULL;
+   }
+   bloom->firstCluster = firstCluster;
+   bloom->noBits = noBits;
+   // Past twice the names it was sized for, false positives climb.
+   bloom->maxNames = noBits / DIR_BLOOM_BITS_PER_NAME * 2;
+   bloom->lastUsed = ++fatx_h->dirIndexClock;
+   for(i = 0; i < DIR_BLOOM_CACHE_SIZE; i++) {
+      if(fatx_h->dirBlooms[i] == NULL) {
+         lru = i;
+         break;
+      }
+      if(fatx_h->dirBlooms[i]->lastUsed < fatx_h->dirBlooms[lru]->lastUsed)
+         lru = i;
+   }
+   fatx_freeDirBloom(fatx_h->dirBlooms[lru]);
+   fatx_h->dirBlooms[lru] = bloom;
+   return bloom;
+}
+
+void
+fatx_dirBloomFromIndex(fatx_handle    * fatx_h,
+                       fatx_dir_index * index)
+{
+   fatx_dir_bloom * bloom;
+   uint32_t         i;
+   if(fatx_findDirBloom(fatx_h, index->firstCluster) != NULL)
+      return;
+   bloom = fatx_newDirBloom(fatx_h, index->firstCluster, index->noUsed);
+   if(bloom == NULL)
+      return;
+   for(i = 0; i < index->noSlots; i++) {
+      if(index->slots[i].state == 1)
+         fatx_bloomAdd(bloom, index->slots[i].hash);
+   }
+}
+
+void
+fatx_bloomAdd(fatx_dir_bloom * bloom,
+              uint32_t         hash)
+{
+   // Double hashing; the step is odd so the probes differ.
+   uint32_t step = ((hash >> 17) | (hash << 15)) * 0x9E3779B1U | 1;
+   uint32_t i, bit;
+   for(i = 0; i < DIR_BLOOM_PROBES; i++) {
+      bit = (hash + i * step) & (bloom->noBits - 1);
+      bloom->bits[bit / 64] |= 1ULL << (bit % 64);
+   }
+   bloom->noNames++;
+}
+
+int
+fatx_bloomTest(fatx_dir_bloom * bloom,
+               uint32_t         hash)
+{
+   uint32_t step = ((hash >> 17) | (hash << 15)) * 0x9E3779B1U | 1;
+   uint32_t i, bit;
+   for(i = 0; i < DIR_BLOOM_PROBES; i++) {
+      bit = (hash + i * step) & (bloom->noBits - 1);
+      if(!(bloom->bits[bit / 64] & (1ULL << (bit % 64))))
+         return 0;
+   }
+   return 1;
+}
+
+int
+fatx_dirBloomLookup(fatx_handle          * fatx_h,
+                    fatx_directory_entry * folder,
+                    const char           * name,
+                    size_t                 nameLen)
+{
+   fatx_dir_bloom * bloom;
+   int              err = 1;
+   pthread_mutex_lock(&fatx_h->dirIndexLock);
+   bloom = fatx_findDirBloom(fatx_h, SWAP32(folder->firstCluster));
+   if(bloom != NULL)
+      err = fatx_bloomTest(bloom, fatx_hashName(name, nameLen)) ? 0 : -ENOENT;
+   pthread_mutex_unlock(&fatx_h->dirIndexLock);
+   return err;
+}
+
+void
+fatx_dirBloomAdd(fatx_handle * fatx_h,
+                 uint32_t      parentCluster,
+                 uint32_t      hash)
+{
+   fatx_dir_bloom * bloom = fatx_findDirBloom(fatx_h, parentCluster);
+   if(bloom == NULL)
+      return;
+   fatx_bloomAdd(bloom, hash);
+   if(bloom->noNames > bloom->maxNames)
+      fatx_dirBloomDrop(fatx_h, parentCluster);
+}
+
+void
+fatx_dirBloomDrop(fatx_handle * fatx_h,
+                  uint32_t      parentCluster)
+{
+   uint32_t i;
+   for(i = 0; i < DIR_BLOOM_CACHE_SIZE; i++) {
+      if(fatx_h->dirBlooms[i] != NULL && fatx_h->dirBlooms[i]->firstCluster == parentCluster) {
+         fatx_freeDirBloom(fatx_h->dirBlooms[i]);
+         fatx_h->dirBlooms[i] = NULL;
+      }
+   }
+}
+
+void
+fatx_freeDirBloom(fatx_dir_bloom * bloom)
+{
+   if(bloom == NULL)
+      return;
+   free(bloom->bits);
+   free(bloom);
+}
+
+int
+fatx_loadDirectoryEntry(fatx_handle          * fatx_h,
+                        fatx_dirent_loc      * loc,
+                        fatx_directory_entry * directoryEntry)
+{
+   fatx_cache_entry * cacheEntry;
+   if(loc->clusterNo == 0) {
+      *directoryEntry = fatx_h->rootDirEntry;
+      return 0;
+   }
+   cacheEntry = fatx_getCluster(fatx_h, loc->clusterNo);
+   if(cacheEntry == NULL)
+      return -EIO;
+   *directoryEntry = cacheEntry->dirEntries[loc->entryNo];
+   fatx_releaseCluster(fatx_h, cacheEntry);
+   return 0;
+}
+
+int
+fatx_loadOpenEntry(fatx_file            * file,
+                   fatx_directory_entry * directoryEntry)
+{
+   if(file->stale)
+      return -ESTALE;
+   return fatx_loadDirectoryEntry(file->fatx_h, &file->loc, directoryEntry);
+}
+
+void
+fatx_markStale(fatx_handle     * fatx_h,
+               fatx_dirent_loc * loc)
+{
+   fatx_file * file;
+   pthread_mutex_lock(&fatx_h->openFilesLock);
+   for(file = fatx_h->openFiles; file != NULL; file = file->next) {
+      if(file->loc.clusterNo == loc->clusterNo && file->loc.entryNo == loc->entryNo)
+         file->stale = 1;
+   }
+   pthread_mutex_unlock(&fatx_h->openFilesLock);
+}
+
+int
+fatx_stageWrite(fatx_file  * file,
+                const char * buf,
+                size_t       size)
+{
+   uint32_t start = file->writeOffset % FAT_CLUSTER_SZ;
+   if(file->writeBuf == NULL) {
+      file->writeBuf = (char *) malloc(FAT_CLUSTER_SZ);
+      if(file->writeBuf == NULL)
+         return -ENOMEM;
+   }
+   size = MIN(size, (size_t) (FAT_CLUSTER_SZ - start - file->writeLen));
+   memcpy(file->writeBuf + start + file->writeLen, buf, size);
+   file->writeLen += size;
+   return size;
+}
+
+int
+fatx_writeStaged(fatx_file * file)
+{
+   fatx_directory_entry directoryEntry;
+   int                  retVal;
+   if(file->writeLen == 0)
+      return 0;
+   retVal = fatx_loadOpenEntry(file, &directoryEntry);
+   if(retVal == 0) {
+      retVal = fatx_writeToDirectoryEntry(file->fatx_h, &directoryEntry, &file->loc,
+                                          &file->cursor,
+                                          file->writeBuf + file->writeOffset % FAT_CLUSTER_SZ,
+                                          file->writeOffset, file->writeLen);
+   }
+   // Staged data that couldn't be written is dropped; the error goes to
+   // whichever call triggered the write.
+   if(retVal >= 0)
+      file->writeOffset += retVal;
+   if(retVal >= 0 && (uint32_t) retVal < file->writeLen)
+      retVal = -ENOSPC;
+   file->writeLen = 0;
+   return retVal < 0 ? retVal : 0;
+}
+
+int
+fatx_writeDirectoryEntry(fatx_handle          * fatx_h,
+                         fatx_dirent_loc      * loc,
+                         fatx_directory_entry * directoryEntry)
+{
+   fatx_cache_entry * cacheEntry;
+   if(loc->clusterNo == 0)
+      return 0;
+   cacheEntry = fatx_getCluster(fatx_h, loc->clusterNo);
+   if(cacheEntry == NULL)
+      return -EIO;
+   cacheEntry->dirEntries[loc->entryNo] = *directoryEntry;
+   fatx_markClusterDirty(fatx_h, cacheEntry);
+   fatx_releaseCluster(fatx_h, cacheEntry);
+   return 0;
+}
+
+time_t
+fatx_makeTimeType(uint16_t date, uint16_t time)
+{
+   struct tm time_struct =  {
+                               .tm_year = ((date & 0xFE00) >> 9) + 80,
+                               .tm_mon = ((date & 0x01E0) >> 5) - 1,
+                               .tm_mday = date & 0x1F,
+                               .tm_hour = time >> 11,
+                               .tm_min = (time >> 5) & 0x3F,
+                               .tm_sec = (time & 0x1F) << 1,
+                               .tm_isdst = -1,
+                               .tm_wday = 0,
+                               .tm_yday = 0,                                                                               };
+   return mktime(&time_struct);
 }
 
 int
 fatx_readFromDirectoryEntry(fatx_handle          * fatx_h,
                             fatx_directory_entry * directoryEntry,
+                            fatx_cursor          * cursor,
                             char                 * buf,
                             off_t                  offset,
                             size_t                 len)
 {
-   uint32_t                    currentClusterNo = SWAP32(directoryEntry->firstCluster);
+   uint32_t                    firstCluster     = SWAP32(directoryEntry->firstCluster);
    uint32_t                    fileClusterNo    = (offset / FAT_CLUSTER_SZ);
-   uint32_t                    i, bytesRead = 0, retVal;
+   uint32_t                    currentClusterNo = 0;
+   uint32_t                    runLength        = 0;
+   uint32_t                    bytesRead = 0, retVal;
+   uint32_t                    i, j, count;
+   char                        direct;
    fatx_cache_entry          * cacheEntry       = NULL;
    if(offset >= SWAP32(directoryEntry->fileSize)) {
       return -EOVERFLOW;
    }
-   len = MIN(len, SWAP32(directoryEntry->fileSize) - offset);
+   len = MIN(len, (size_t) (SWAP32(directoryEntry->fileSize) - offset));
    retVal = len;
+   direct = len >= DIRECT_READ_MIN_SZ;
+   fatx_readahead(fatx_h, firstCluster, fileClusterNo, (offset + len) / FAT_CLUSTER_SZ);
    offset = offset % FAT_CLUSTER_SZ;
-   FATX_LOCK(fatx_h);
-   for(i = 0; i < fileClusterNo; i++) {
-      currentClusterNo = fatx_readFatEntry(fatx_h, currentClusterNo);
-      if(fatx_isEOC(fatx_h, currentClusterNo) || IS_FREE_CLUSTER(currentClusterNo)) {
-         retVal = -EBADF;
-         goto finish;
-      }
-   }
    while(len > 0) {
-      if(fatx_isEOC(fatx_h, currentClusterNo) || IS_FREE_CLUSTER(currentClusterNo)) {
-         retVal = -EBADF;
-         goto finish;
+      if(runLength == 0) {
+         currentClusterNo = fatx_seekCluster(fatx_h, firstCluster, cursor, fileClusterNo, &runLength);
+         if(currentClusterNo == 0) {
+            retVal = -EBADF;
+            goto finish;
+         }
       }
-      bytesRead = MIN(len, FAT_CLUSTER_SZ - offset);
+      if(direct && offset == 0 && len >= FAT_CLUSTER_SZ) {
+         // Whole clusters go straight from disk into the caller's buffer,
+         // one read per contiguous run. Cached clusters may be newer than
+         // the disk, so those are copied from the cache instead.
+         count = MIN(runLength, len / FAT_CLUSTER_SZ);
+         for(i = 0; i < count; i = j) {
+            cacheEntry = fatx_lookupCluster(fatx_h, currentClusterNo + i);
+            if(cacheEntry != NULL) {
+               memcpy(buf + i * FAT_CLUSTER_SZ, cacheEntry->data, FAT_CLUSTER_SZ);
+               fatx_releaseCluster(fatx_h, cacheEntry);
+               j = i + 1;
+               continue;
+            }
+            for(j = i + 1; j < count; j++) {
+               cacheEntry = fatx_lookupCluster(fatx_h, currentClusterNo + j);
+               if(cacheEntry != NULL) {
+                  fatx_releaseCluster(fatx_h, cacheEntry);
+                  break;
+               }
+            }
+            if(fatx_readClusters(fatx_h, currentClusterNo + i, j - i, buf + i * FAT_CLUSTER_SZ)) {
+               retVal = -EIO;
+               goto finish;
+            }
+         }
+         len -= count * FAT_CLUSTER_SZ;
+         buf += count * FAT_CLUSTER_SZ;
+         fileClusterNo += count;
+         currentClusterNo += count;
+         runLength -= count;
+         continue;
+      }
+      bytesRead = MIN(len, (size_t) (FAT_CLUSTER_SZ - offset));
       cacheEntry = fatx_getCluster(fatx_h, currentClusterNo);
+      if(cacheEntry == NULL) {
+         retVal = -EIO;
+         goto finish;
+      }
       memcpy(buf, cacheEntry->data + offset, bytesRead);
+      fatx_releaseCluster(fatx_h, cacheEntry);
       len -= bytesRead;
       buf += bytesRead;
       offset = 0;
-      currentClusterNo = fatx_readFatEntry(fatx_h, currentClusterNo);
+      fileClusterNo++;
+      currentClusterNo++;
+      runLength--;
    }
+   // Leave the cursor on the last cluster read; the next sequential read
+   // may start in it.
+   if(retVal > 0)
+      fatx_setCursor(fatx_h, cursor, fileClusterNo - 1, currentClusterNo - 1, runLength + 1);
 finish:
-   FATX_UNLOCK(fatx_h);
    return retVal;
 }
 
 int
 fatx_writeToDirectoryEntry(fatx_handle          * fatx_h,
                            fatx_directory_entry * directoryEntry,
-                           char                 * buf,
+                           fatx_dirent_loc      * loc,
+                           fatx_cursor          * cursor,
+                           const char           * buf,
                            off_t                  offset,
                            size_t                 len)
 {
-   uint32_t                    currentClusterNo = SWAP32(directoryEntry->firstCluster);
+   uint32_t                    firstCluster     = SWAP32(directoryEntry->firstCluster);
    uint32_t                    fileClusterNo    = (offset / FAT_CLUSTER_SZ);
-   uint32_t                    i, bytesWrite = 0, retVal;
-   uint32_t                    nextClusterNo = 0;
+   uint32_t                    currentClusterNo = 0;
+   uint32_t                    prevClusterNo    = 0;
+   uint32_t                    runLength        = 0;
+   uint32_t                    bytesWrite = 0, retVal;
    uint32_t                    filesize = offset;
    fatx_cache_entry          * cacheEntry       = NULL;
+   int                         err;
    if(offset > SWAP32(directoryEntry->fileSize)) {
       return -EOVERFLOW;
    }
    retVal = len;
    offset = offset % FAT_CLUSTER_SZ;
-   FATX_LOCK(fatx_h);
-   for(i = 0; i < fileClusterNo; i++) {
-      currentClusterNo = fatx_readFatEntry(fatx_h, currentClusterNo);
-      if(fatx_isEOC(fatx_h, currentClusterNo) || IS_FREE_CLUSTER(currentClusterNo)) {
-         retVal = -EBADF;
-         goto finish;
-      }
-   }
    while(len > 0) {
-      bytesWrite = MIN(len, FAT_CLUSTER_SZ - offset);
+      if(runLength == 0)
+         currentClusterNo = fatx_seekCluster(fatx_h, firstCluster, cursor, fileClusterNo, &runLength);
+      if(currentClusterNo == 0) {
+         // Past the end of the chain, link in a run for the rest of the write.
+         if(prevClusterNo == 0 && fileClusterNo > 0)
+            prevClusterNo = fatx_mapCluster(fatx_h, firstCluster, fileClusterNo - 1, NULL);
+         if(prevClusterNo == 0) {
+            retVal = -EBADF;
+            goto finish;
+         }
+         err = fatx_allocRun(fatx_h, prevClusterNo,
+                             (offset + len + FAT_CLUSTER_SZ - 1) / FAT_CLUSTER_SZ,
+                             RUN_SEARCH_LIMIT, &currentClusterNo, &runLength);
+         if(err == 0) {
+            err = fatx_writeFatEntry(fatx_h, prevClusterNo, currentClusterNo);
+            if(err)
+               fatx_freeChain(fatx_h, currentClusterNo);
+         }
+         if(err)
+            goto error;
+         fatx_extendExtentMap(fatx_h, firstCluster, currentClusterNo, runLength);
+      }
+      bytesWrite = MIN(len, (size_t) (FAT_CLUSTER_SZ - offset));
       cacheEntry = fatx_getCluster(fatx_h, currentClusterNo);
+      if(cacheEntry == NULL) {
+         err = -EIO;
+         goto error;
+      }
       memcpy(cacheEntry->data + offset, buf, bytesWrite);
-      cacheEntry->dirty = 1;
+      fatx_markClusterDirty(fatx_h, cacheEntry);
+      fatx_releaseCluster(fatx_h, cacheEntry);
       len -= bytesWrite;
       buf += bytesWrite;
       filesize += bytesWrite;
       offset = 0;
-      nextClusterNo = fatx_readFatEntry(fatx_h, currentClusterNo);
-      if(fatx_isEOC(fatx_h, nextClusterNo)) {
-         nextClusterNo = fatx_findFreeCluster(fatx_h, currentClusterNo);
-         if (nextClusterNo == 0) {
-            retVal = -ENOSPC;
-            goto finish;
-         }
-         fatx_writeFatEntry(fatx_h, currentClusterNo, nextClusterNo);
-      }
-      currentClusterNo = nextClusterNo;
+      fileClusterNo++;
+      prevClusterNo = currentClusterNo;
+      currentClusterNo = --runLength ? currentClusterNo + 1 : 0;
    }
+   if(prevClusterNo != 0)
+      fatx_setCursor(fatx_h, cursor, fileClusterNo - 1, prevClusterNo, runLength + 1);
 finish:
-   directoryEntry->fileSize = SWAP32(MAX(filesize, SWAP32(directoryEntry->fileSize)));
-   FATX_UNLOCK(fatx_h);
+   if(filesize > SWAP32(directoryEntry->fileSize)) {
+      directoryEntry->fileSize = SWAP32(filesize);
+      if(fatx_writeDirectoryEntry(fatx_h, loc, directoryEntry))
+         retVal = -EIO;
+   }
    return retVal;
+
+error:
+   // Report what did land, if anything.
+   if(retVal == len)
+      retVal = err;
+   else
+      retVal -= len;
+   goto finish;
 }
 
-void
+int
 fatx_initDirCluster(fatx_handle * fatx_h,
                     uint32_t      clusterNo)
 {
    fatx_cache_entry * cacheEntry;
    uint32_t           i;
-   FATX_LOCK(fatx_h);
    cacheEntry = fatx_getCluster(fatx_h, clusterNo);
-   cacheEntry->dirty = 1;
+   if(cacheEntry == NULL)
+      return -EIO;
+   fatx_markClusterDirty(fatx_h, cacheEntry);
    for(i = 0; i < DIR_ENTRIES_PER_CLUSTER; i++) {
       cacheEntry->dirEntries[i].filenameSz = 0xFF;
    }
-   FATX_UNLOCK(fatx_h);
+   fatx_releaseCluster(fatx_h, cacheEntry);
+   return 0;
 }
 
-fatx_directory_entry *
-fatx_getFirstOpenDirectoryEntry(fatx_handle * fatx_h, fatx_directory_entry * folder)
+int
+fatx_growDirectory(fatx_handle     * fatx_h,
+                   uint32_t          firstCluster,
+                   uint32_t          lastCluster,
+                   fatx_dirent_loc * loc)
+{
+   uint32_t freeCluster = fatx_findFreeCluster(fatx_h, lastCluster);
+   int      err;
+   if(freeCluster == 0)
+      return -ENOSPC;
+   err = fatx_writeFatEntry(fatx_h, freeCluster, FATX_EOC(fatx_h));
+   if(err)
+      return err;
+   // The new cluster is ready before the directory's chain points at it.
+   err = fatx_initDirCluster(fatx_h, freeCluster);
+   if(err == 0)
+      err = fatx_writeFatEntry(fatx_h, lastCluster, freeCluster);
+   if(err) {
+      fatx_writeFatEntry(fatx_h, freeCluster, 0);
+      return err;
+   }
+   fatx_extendExtentMap(fatx_h, firstCluster, freeCluster, 1);
+   loc->clusterNo = freeCluster;
+   loc->entryNo = 0;
+   return 0;
+}
+
+int
+fatx_mkFileInDirectory(fatx_handle          * fatx_h,
+                       fatx_directory_entry * directoryEntry,
+                       const char           * filename,
+                       size_t                 filenameLen,
+                       fatx_dirent_loc      * newLoc)
+{
+   fatx_directory_entry newFile;
+   fatx_dirent_loc      loc;
+   uint32_t             newFileCluster;
+   int                  err;
+   // See if the file already exists.
+   err = fatx_findDirectoryEntry(fatx_h, filename, filenameLen, directoryEntry, &newFile, &loc);
+   if(err == 0)
+      return -EEXIST;
+   if(err != -ENOENT)
+      return err;
+   err = fatx_getFirstOpenDirectoryEntry(fatx_h, directoryEntry, &loc);
+   if(err)
+      return err;
+   newFileCluster = fatx_findFreeCluster(fatx_h, SWAP32(directoryEntry->firstCluster));
+   if(newFileCluster == 0)
+      return -ENOSPC;
+   memset(&newFile, 0, sizeof(fatx_directory_entry));
+   newFile.filenameSz = filenameLen;
+   memcpy(newFile.filename, filename, filenameLen);
+   newFile.firstCluster = SWAP32(newFileCluster);
+   err = fatx_writeFatEntry(fatx_h, newFileCluster, FATX_EOC(fatx_h));
+   if(err)
+      return err;
+   fatx_invalidateExtentMap(fatx_h, newFileCluster);
+   err = fatx_writeDirectoryEntry(fatx_h, &loc, &newFile);
+   if(err) {
+      fatx_writeFatEntry(fatx_h, newFileCluster, 0);
+      return err;
+   }
+   // Replaces any cached negative entry for the name.
+   fatx_dcacheInsert(fatx_h, SWAP32(directoryEntry->firstCluster), newFile.filename,
+                     newFile.filenameSz, &loc);
+   fatx_dirIndexInsert(fatx_h, SWAP32(directoryEntry->firstCluster), newFile.filename,
+                       newFile.filenameSz, &loc);
+   if(newLoc != NULL)
+      *newLoc = loc;
+   return 0;
+}
+
+int
+fatx_deleteEntry(fatx_handle          * fatx_h,
+                 uint32_t               parentCluster,
+                 fatx_dirent_loc      * loc,
+                 fatx_directory_entry * directoryEntry)
 {
+   uint32_t firstCluster = SWAP32(directoryEntry->firstCluster);
+   uint8_t  nameLen = directoryEntry->filenameSz;
+   int      err;
+   directoryEntry->filenameSz = DELETED_ENTRY;
+   err = fatx_writeDirectoryEntry(fatx_h, loc, directoryEntry);
+   directoryEntry->filenameSz = nameLen;
+   if(err)
+      return err;
+   fatx_markStale(fatx_h, loc);
+   fatx_dirIndexRemove(fatx_h, parentCluster, directoryEntry->filename, nameLen, loc);
+   fatx_dcacheInsert(fatx_h, parentCluster, directoryEntry->filename, nameLen, NULL);
+   if(IS_FOLDER(directoryEntry)) {
+      // Nothing cached about the folder's contents may outlive it.
+      fatx_dcachePurgeDir(fatx_h, firstCluster);
+      pthread_mutex_lock(&fatx_h->dirIndexLock);
+      fatx_dirIndexDrop(fatx_h, firstCluster);
+      fatx_dirBloomDrop(fatx_h, firstCluster);
+      pthread_mutex_unlock(&fatx_h->dirIndexLock);
+   }
+   // Clusters that can't be freed are lost, but the entry is gone.
+   if(firstCluster != 0)
+      return fatx_freeChain(fatx_h, firstCluster);
+   return 0;
+}
+
+int
+fatx_getFirstOpenDirectoryEntry(fatx_handle          * fatx_h,
+                                fatx_directory_entry * folder,
+                                fatx_dirent_loc      * loc)
+{
+   fatx_dir_iter          iter;
    fatx_directory_entry * entry = NULL;
-   uint32_t               freeCluster;
-   fatx_cache_entry     * cacheEntry;
-   FATX_LOCK(fatx_h);
-   fatx_dir_iter * iter = fatx_createDirIter(fatx_h, folder);
-   while ( (entry = fatx_readDirectoryEntry(fatx_h, iter)) ) {
-      if(!IS_VALID_ENTRY(entry)) goto finish;
-   }
-   if(entry == NULL) {
-      if(iter->entryNo == DIR_ENTRIES_PER_CLUSTER &&
-         // Hit the last spot the last cluster of a folder. need to make a new one.
-         fatx_isEOC(fatx_h, fatx_readFatEntry(fatx_h, iter->clusterNo))) {
-         freeCluster = fatx_findFreeCluster(fatx_h, iter->clusterNo);
-         if(freeCluster == 0) goto finish;
-         fatx_writeFatEntry(fatx_h, iter->clusterNo, SWAP32(freeCluster));
-         fatx_initDirCluster(fatx_h, freeCluster);
-         cacheEntry = fatx_getCluster(fatx_h, freeCluster);
-         entry = cacheEntry->dirEntries;
+   fatx_dir_index       * index;
+   int                    err = 0;
+   pthread_mutex_lock(&fatx_h->dirIndexLock);
+   index = fatx_getDirIndex(fatx_h, folder ? folder : &fatx_h->rootDirEntry);
+   if(index != NULL) {
+      // The slot is only taken off the index once the entry is written,
+      // by fatx_dirIndexInsert.
+      if(index->noFreeSlots > 0) {
+         *loc = index->freeSlots[index->noFreeSlots - 1];
+      } else if(index->end.entryNo < DIR_ENTRIES_PER_CLUSTER) {
+         *loc = index->end;
       } else {
-         // somewhere at the end of a folder.
-         cacheEntry = fatx_getCluster(fatx_h, iter->clusterNo);
-         entry = cacheEntry->dirEntries + iter->entryNo;
-         cacheEntry->dirty = 1;
+         err = fatx_growDirectory(fatx_h, index->firstCluster, index->end.clusterNo, loc);
+         if(err == 0)
+            index->end = *loc;
       }
+      pthread_mutex_unlock(&fatx_h->dirIndexLock);
+      return err;
    }
-finish:
-   FATX_UNLOCK(fatx_h);
-   return entry;
+   pthread_mutex_unlock(&fatx_h->dirIndexLock);
+   if(fatx_initDirIter(fatx_h, &iter, folder))
+      return -ENOTDIR;
+   while ( (entry = fatx_readDirectoryEntry(fatx_h, &iter)) ) {
+      if(!IS_VALID_ENTRY(entry)) {
+         *loc = iter.loc;
+         return 0;
+      }
+   }
+   if(iter.err)
+      return iter.err;
+   if(iter.entryNo == DIR_ENTRIES_PER_CLUSTER) {
+      // Hit the last spot the last cluster of a folder. need to make a new one.
+      if(folder == NULL)
+         folder = &fatx_h->rootDirEntry;
+      return fatx_growDirectory(fatx_h, SWAP32(folder->firstCluster), iter.clusterNo, loc);
+   }
+   // somewhere at the end of a folder.
+   loc->clusterNo = iter.clusterNo;
+   loc->entryNo = iter.entryNo;
+   return 0;
+}
+
+
+int
+fatx_walkPush(fatx_walk_state *      walk,
+              uint32_t               id,
+              char *                 path,
+              fatx_directory_entry * entry)
+{
+   fatx_walk_queue * queue = walk->queues + id;
+   fatx_walk_item  * items;
+   uint32_t          maxItems;
+   // Count the item before it is visible, so a thief can't take it first.
+   pthread_mutex_lock(&walk->lock);
+   walk->noPending++;
+   walk->noQueued++;
+   pthread_mutex_unlock(&walk->lock);
+   pthread_mutex_lock(&queue->lock);
+   if(queue->tail == queue->maxItems) {
+      if(queue->head > 0) {
+         // Reuse the room left by stolen items.
+         memmove(queue->items, queue->items + queue->head,
+                 (queue->tail - queue->head) * sizeof(fatx_walk_item));
+         queue->tail -= queue->head;
+         queue->head = 0;
+      } else {
+         maxItems = queue->maxItems ? queue->maxItems * 2 : WALK_BATCH;
+         items = (fatx_walk_item *) realloc(queue->items, maxItems * sizeof(fatx_walk_item));
+         if(items == NULL) {
+            pthread_mutex_unlock(&queue->lock);
+            pthread_mutex_lock(&walk->lock);
+            walk->noPending--;
+            walk->noQueued--;
+            pthread_mutex_unlock(&walk->lock);
+            return -ENOMEM;
+         }
+         queue->items = items;
+         queue->maxItems = maxItems;
+      }
+   }
+   queue->items[queue->tail].path = path;
+   queue->items[queue->tail].entry = *entry;
+   queue->tail++;
+   pthread_mutex_unlock(&queue->lock);
+   pthread_mutex_lock(&walk->lock);
+   pthread_cond_signal(&walk->changed);
+   pthread_mutex_unlock(&walk->lock);
+   return 0;
+}
+
+int
+fatx_walkTake(fatx_walk_state * walk,
+              uint32_t          id,
+              fatx_walk_item *  item)
+{
+   fatx_walk_queue * queue;
+   uint32_t          i;
+   int               found = 0;
+   for(i = 0; i < walk->noThreads && !found; i++) {
+      queue = walk->queues + (id + i) % walk->noThreads;
+      pthread_mutex_lock(&queue->lock);
+      if(queue->head < queue->tail) {
+         // Our own newest directory is likely still cached; steal the
+         // oldest from others, which roots the biggest unwalked subtree.
+         if(i == 0)
+            *item = queue->items[--queue->tail];
+         else
+            *item = queue->items[queue->head++];
+         if(queue->head == queue->tail)
+            queue->head = queue->tail = 0;
+         found = 1;
+      }
+      pthread_mutex_unlock(&queue->lock);
+   }
+   if(found) {
+      pthread_mutex_lock(&walk->lock);
+      walk->noQueued--;
+      pthread_mutex_unlock(&walk->lock);
+   }
+   return found;
+}
+
+void
+fatx_walkStop(fatx_walk_state * walk,
+              int               result)
+{
+   pthread_mutex_lock(&walk->lock);
+   if(walk->result == 0)
+      walk->result = result;
+   pthread_cond_broadcast(&walk->changed);
+   pthread_mutex_unlock(&walk->lock);
+}
+
+void
+fatx_walkDirectory(fatx_walk_state * walk,
+                   uint32_t          id,
+                   fatx_walk_item *  item)
+{
+   fatx_handle          * fatx_h = walk->fatx_h;
+   fatx_dir_iter          iter;
+   fatx_directory_entry * directoryEntry;
+   fatx_directory_entry   entries[WALK_BATCH];
+   fatx_dirent_plus_t     dirent;
+   size_t                 pathLen = strlen(item->path);
+   size_t                 noEntries = WALK_BATCH, i;
+   char                 * path, * subPath;
+   char                   stopped;
+   int                    err = 0;
+   if(fatx_initDirIter(fatx_h, &iter, &item->entry))
+      return;
+   // Room for the directory's path, a separator, a name and the NUL.
+   path = (char *) malloc(pathLen + FATX_MAX_NAME_LEN + 2);
+   if(path == NULL) {
+      fatx_walkStop(walk, -ENOMEM);
+      return;
+   }
+   memcpy(path, item->path, pathLen);
+   path[pathLen] = '/';
+   while(noEntries == WALK_BATCH && err == 0) {
+      noEntries = 0;
+      FATX_RDLOCK(fatx_h);
+      while(noEntries < WALK_BATCH && (directoryEntry = fatx_scanDirectory(fatx_h, &iter, NULL, 0))) {
+         entries[noEntries++] = *directoryEntry;
+         if(IS_FOLDER(directoryEntry))
+            fatx_prefetchChain(fatx_h, SWAP32(directoryEntry->firstCluster), 0,
+                               WALK_PREFETCH_CLUSTERS);
+      }
+      FATX_UNLOCK(fatx_h);
+      for(i = 0; i < noEntries && err == 0; i++) {
+         fatx_fillDirentPlus(fatx_h, entries + i, &dirent);
+         memcpy(path + pathLen + 1, dirent.d_name, dirent.d_namelen + 1);
+         err = walk->callback(path, &dirent, walk->arg);
+         if(err == 0 && IS_FOLDER(entries + i)) {
+            subPath = (char *) malloc(pathLen + dirent.d_namelen + 2);
+            if(subPath == NULL) {
+               err = -ENOMEM;
+               break;
+            }
+            memcpy(subPath, path, pathLen + dirent.d_namelen + 2);
+            err = fatx_walkPush(walk, id, subPath, entries + i);
+            if(err)
+               free(subPath);
+         }
+      }
+      if(err == 0)
+         err = iter.err;
+      // Stop early if another walker stopped the walk.
+      pthread_mutex_lock(&walk->lock);
+      stopped = walk->result != 0;
+      pthread_mutex_unlock(&walk->lock);
+      if(stopped)
+         break;
+   }
+   if(err)
+      fatx_walkStop(walk, err);
+   free(path);
 }
 
+void *
+fatx_walkerMain(void * arg)
+{
+   fatx_walker     * walker = (fatx_walker *) arg;
+   fatx_walk_state * walk = walker->walk;
+   fatx_walk_item    item;
+   for(;;) {
+      pthread_mutex_lock(&walk->lock);
+      while(walk->result == 0 && walk->noPending > 0 && walk->noQueued == 0)
+         pthread_cond_wait(&walk->changed, &walk->lock);
+      if(walk->result != 0 || walk->noPending == 0) {
+         pthread_mutex_unlock(&walk->lock);
+         break;
+      }
+      pthread_mutex_unlock(&walk->lock);
+      // Another walker may have taken it first.
+      if(!fatx_walkTake(walk, walker->id, &item))
+         continue;
+      fatx_walkDirectory(walk, walker->id, &item);
+      free(item.path);
+      pthread_mutex_lock(&walk->lock);
+      if(--walk->noPending == 0)
+         pthread_cond_broadcast(&walk->changed);
+      pthread_mutex_unlock(&walk->lock);
+   }
+   return NULL;
+}
@@ -11,11 +11,16 @@
 
 #include <pthread.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <stdint.h>
+#include <time.h>
 
 #define MAX(x,y) ( ((x) > (y)) ? (x) : (y) )
 #define MIN(x,y) ( ((x) < (y)) ? (x) : (y) )
 
+/** Count trailing zero bits of a non-zero 64 bit word */
+#define CTZ64(x) __builtin_ctzll(x)
+
 #if (__APPLE__)
 #include <libkern/OSByteOrder.h>
 #define SWAP32(x) OSSwapHostToBigInt32(x)
@@ -32,6 +37,23 @@ enum FAT_TYPE {
    FATX32  
 };
 
+/** Directory scan kernels */
+enum SCAN_ISA {
+   /** One entry at a time */
+   SCAN_SCALAR = 0,
+   /** Four entries per compare */
+   SCAN_SSE2,
+   /** Eight entries per compare */
+   SCAN_AVX2
+};
+
+/** Whether the SSE2 and AVX2 scan kernels are built */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define FATX_SCAN_X86 1
+#else
+#define FATX_SCAN_X86 0
+#endif
+
 /** Number of directory entries in a cluster */
 #define DIR_ENTRIES_PER_CLUSTER 256
 
@@ -44,12 +66,18 @@ enum FAT_TYPE {
 /** Size of a FAT cluster */
 #define FAT_CLUSTER_SZ 0x4000L
 
-/** Number of cache clusters */
-#define CACHE_SIZE 0x20
+/** Default number of cache clusters */
+#define CACHE_SIZE 0x200
+
+/** Number of ways in each cluster cache set */
+#define CACHE_WAYS 8
 
 /** Number of FAT cache pages */
 #define FAT_CACHE_SIZE 0x20
 
+/** Page number of a FAT cache entry that holds no page */
+#define FAT_PAGE_NONE 0xFFFFFFFFU
+
 /** Number of FATX32 entries in a page */
 #define FATX32_ENTRIES_PER_PAGE 0x400
 
@@ -59,9 +87,78 @@ enum FAT_TYPE {
 /** Size of a FAT page */
 #define FAT_PAGE_SZ 0x1000L
 
-/** Lock the volume */
-#define FATX_LOCK(x) pthread_mutex_lock(&(x)->devLock)
-#define FATX_UNLOCK(x) pthread_mutex_unlock(&(x)->devLock)
+/** Maximum number of FAT pages transferred in one go when reading or writing the whole FAT */
+#define FAT_IO_PAGES 0x40
+
+/** Number of free runs a growing file looks at for one that fits */
+#define RUN_SEARCH_LIMIT 64
+
+/** Bytes read and written at a time when copying on the device by hand */
+#define COPY_CHUNK_SZ 0x100000L
+
+/** Reads of at least this many bytes bypass the cache for whole clusters */
+#define DIRECT_READ_MIN_SZ 0x10000L
+
+/** Maximum number of clusters or FAT pages merged into one vectored write */
+#define FLUSH_MAX_IOV 0x40
+
+/** Number of cached file extent maps */
+#define EXTENT_CACHE_SIZE 0x40
+
+/** Number of slots in the path lookup cache */
+#define DCACHE_SIZE 0x400
+
+/** Number of directories with a name index */
+#define DIR_INDEX_CACHE_SIZE 0x40
+
+/** Default memory budget of the directory name indexes, in bytes */
+#define DIR_INDEX_BUDGET 0x400000
+
+/** Smallest directory name index, in slots */
+#define DIR_INDEX_MIN_SLOTS 0x40
+
+/** Number of cached directory Bloom filters */
+#define DIR_BLOOM_CACHE_SIZE 0x100
+
+/** Bloom filter bits per name the filter is sized for */
+#define DIR_BLOOM_BITS_PER_NAME 16
+
+/** Smallest number of names a Bloom filter is sized for */
+#define DIR_BLOOM_MIN_NAMES 0x40
+
+/** Bits set and tested per name */
+#define DIR_BLOOM_PROBES 4
+
+/** Read-ahead window, in clusters, once a file is read sequentially */
+#define READAHEAD_MIN 0x4
+
+/** Largest read-ahead window, in clusters */
+#define READAHEAD_MAX 0x100
+
+/** Maximum number of contiguous runs hinted per read-ahead */
+#define READAHEAD_MAX_RUNS 0x10
+
+/** Clusters of a queued directory prefetched by fatx_walk() */
+#define WALK_PREFETCH_CLUSTERS 0x4
+
+/** Appends through an open file smaller than this are staged in its write
+    buffer */
+#define WRITE_COMBINE_MAX 0x1000
+
+/** Directory entries a walker reads per metadata lock hold */
+#define WALK_BATCH 0x40
+
+/** Most threads fatx_walk() will walk with */
+#define WALK_MAX_THREADS 0x100
+
+/**
+ * Lock the volume metadata. Lookups take the lock shared, allocation and
+ * directory changes take it exclusively. The public entry points take the
+ * lock; the internal functions expect it to be held.
+ */
+#define FATX_RDLOCK(x) pthread_rwlock_rdlock(&(x)->metaLock)
+#define FATX_WRLOCK(x) pthread_rwlock_wrlock(&(x)->metaLock)
+#define FATX_UNLOCK(x) pthread_rwlock_unlock(&(x)->metaLock)
 
 /** FATX directory entry */
 typedef struct fatx_directory_entry {
@@ -95,10 +192,6 @@ typedef struct fatx_fat_cache_entry {
    uint32_t pageNo;
    /** Whether this fat page has been written to. */
    char     dirty;
-   /** Number of free clusters in this FAT page. */
-   uint16_t noFreeCluster;
-   /** First free cluster number */
-   uint16_t firstFreeCluster;
    /** The actual FAT entries */
    union {
       char     data[FAT_PAGE_SZ];
@@ -111,48 +204,285 @@ typedef struct fatx_fat_cache_entry {
 typedef struct fatx_cache_entry {
    /** The cluster number of this entry */
    uint32_t       clusterNo;
+   /** Whether this entry holds a loaded cluster */
+   char           valid;
    /** Dirty flag */
    char           dirty;
+   /** Number of users of the entry; entries in use are never evicted */
+   uint32_t       refCount;
+   /** Set clock value of the last access, used for LRU replacement */
+   uint64_t       lastUsed;
+   /** This entry's own cluster sized buffer */
+   char         * buffer;
    union {
       /** Field to access the directory entries in the cluster with */
-      fatx_directory_entry dirEntries[DIR_ENTRIES_PER_CLUSTER];
-      /** Pointer to the actual data */
-      char                 data[FAT_CLUSTER_SZ];
+      fatx_directory_entry * dirEntries;
+      /** Pointer to the actual data; either buffer or the image mapping */
+      char                 * data;
    };
 } fatx_cache_entry;
 
+/** Cluster cache set */
+typedef struct fatx_cache_set {
+   /** Lock for the ways of this set */
+   pthread_mutex_t lock;
+   /** Signalled when a way of this set is released */
+   pthread_cond_t  released;
+   /** Access clock for LRU replacement within the set */
+   uint64_t        clock;
+} fatx_cache_set;
+
+/** Location of a directory entry on disk */
+typedef struct fatx_dirent_loc {
+   /** Cluster holding the entry; 0 for the root directory entry */
+   uint32_t       clusterNo;
+   /** Index of the entry within the cluster */
+   uint32_t       entryNo;
+} fatx_dirent_loc;
+
+/** Path lookup cache slot, mapping a name in a directory to its entry */
+typedef struct fatx_dcache_entry {
+   /** First cluster of the parent directory; 0 for an unused slot */
+   uint32_t        parentCluster;
+   /** Length of the name */
+   uint8_t         nameLen;
+   /** Whether the name is known not to exist in the directory */
+   char            negative;
+   /** The name, not NUL terminated */
+   char            name[42];
+   /** Location of the directory entry; unused for negative slots */
+   fatx_dirent_loc loc;
+} fatx_dcache_entry;
+
+/** Directory name index slot */
+typedef struct fatx_dir_index_slot {
+   /** Hash of the name */
+   uint32_t        hash;
+   /** Cluster holding the directory entry */
+   uint32_t        clusterNo;
+   /** Index of the directory entry within the cluster */
+   uint16_t        entryNo;
+   /** 0 for an empty slot, 1 for a used one, 2 for a deleted one */
+   uint16_t        state;
+} fatx_dir_index_slot;
+
+/** Name index of one directory, an open addressed hash table */
+typedef struct fatx_dir_index {
+   /** First cluster of the directory */
+   uint32_t              firstCluster;
+   /** Number of slots, a power of two */
+   uint32_t              noSlots;
+   /** Number of used slots */
+   uint32_t              noUsed;
+   /** Number of deleted slots */
+   uint32_t              noDeleted;
+   /** Index clock value of the last access, used for LRU eviction */
+   uint64_t              lastUsed;
+   /** The slots */
+   fatx_dir_index_slot * slots;
+   /** Locations of deleted entries that can be reused */
+   fatx_dirent_loc     * freeSlots;
+   /** Number of reusable deleted entries */
+   uint32_t              noFreeSlots;
+   /** Number of free slot locations allocated */
+   uint32_t              maxFreeSlots;
+   /** Where new entries go once there are no free slots: the end of
+       directory marker, or one past the last entry of a full cluster */
+   fatx_dirent_loc       end;
+} fatx_dir_index;
+
+/**
+ * Bloom filter over the names in one directory. Names are never taken out,
+ * so a removed name can still test positive until the filter is rebuilt.
+ */
+typedef struct fatx_dir_bloom {
+   /** First cluster of the directory */
+   uint32_t   firstCluster;
+   /** Number of bits, a power of two */
+   uint32_t   noBits;
+   /** Number of names added */
+   uint32_t   noNames;
+   /** Number of names past which the filter is too full and is dropped */
+   uint32_t   maxNames;
+   /** Index clock value of the last access, used for LRU eviction */
+   uint64_t   lastUsed;
+   /** The bits */
+   uint64_t * bits;
+} fatx_dir_bloom;
+
+/** A run of physically contiguous clusters in a file */
+typedef struct fatx_extent {
+   /** Index within the file of the first cluster in the run */
+   uint32_t       fileClusterNo;
+   /** First cluster of the run on disk */
+   uint32_t       clusterNo;
+   /** Number of clusters in the run */
+   uint32_t       length;
+} fatx_extent;
+
+/** Run length map of a file's cluster chain */
+typedef struct fatx_extent_map {
+   /** First cluster of the file, used as the cache key */
+   uint32_t       firstCluster;
+   /** Number of extents in use */
+   uint32_t       noExtents;
+   /** Number of extents allocated */
+   uint32_t       maxExtents;
+   /** Extents, ordered by file cluster */
+   fatx_extent  * extents;
+   /** File cluster a sequential reader would continue from */
+   uint32_t       nextRead;
+   /** Current read-ahead window in clusters; 0 while reads look random */
+   uint32_t       raWindow;
+   /** File cluster up to which read-ahead has been issued */
+   uint32_t       raEnd;
+} fatx_extent_map;
+
 /** Internal fatx structure */
 typedef struct fatx_handle {
    /** Mount options */
    fatx_options_t         options;
    /** File descriptor of the device */
    int                    dev; 
-   /** Mutex attributes */
-   pthread_mutexattr_t    mutexAttr;
-   /** Lock to synchronize access to the device */
-   pthread_mutex_t        devLock; 
+   /** Lock for the FAT and directory metadata */
+   pthread_rwlock_t       metaLock;
+   /** Lock for the FAT page cache */
+   pthread_mutex_t        fatLock;
+   /** Lock for the extent map cache */
+   pthread_mutex_t        extentLock;
+   /** Serializes flushes and guards the background flusher's wake ups */
+   pthread_mutex_t        flushLock;
+   /** Lock for the path lookup cache */
+   pthread_mutex_t        dcacheLock;
+   /** Lock for the directory name indexes */
+   pthread_mutex_t        dirIndexLock;
+   /** Lock for the list of open files */
+   pthread_mutex_t        openFilesLock;
+   /** Open files, so removing a file can make its handles stale */
+   struct fatx_file     * openFiles;
    /** Number of clusters in the partition */
    uint32_t               nClusters; 
    /** Number of fat pages */
    uint32_t               noFatPages;
    /** FAT type, either fat16 or fat32 */
    enum FAT_TYPE          fatType; 
+   /** Directory scan kernels this CPU runs */
+   enum SCAN_ISA          scanIsa;
    /** Offset to the start of the data. */
    off_t                  dataStart;
    /** Root directory entry */
    fatx_directory_entry   rootDirEntry;
-   /** Cache table */
-   fatx_cache_entry       cache[CACHE_SIZE];
+   /** Cache table, cacheSets sets of CACHE_WAYS entries each */
+   fatx_cache_entry     * cache;
+   /** Cluster buffers of the cache entries */
+   char                 * cacheData;
+   /** Locks and clocks of the cluster cache sets */
+   fatx_cache_set       * sets;
+   /** Number of sets in the cluster cache */
+   uint32_t               cacheSets;
    /** FAT cache */
    fatx_fat_cache_entry   fatCache[FAT_CACHE_SIZE];
+   /** Size of the FAT in bytes */
+   size_t                 fatSize;
+   /** Resident FAT in host byte order; NULL when the FAT is paged through fatCache */
+   uint32_t             * fat;
+   /** Dirty flag for every FAT page of the resident FAT */
+   char                 * fatDirty;
+   /** Mapping of the whole image; NULL when not mapped */
+   char                 * map;
+   /** Size of the image mapping */
+   size_t                 mapSize;
+   /** Free cluster bitmap, a set bit marks a free cluster */
+   uint64_t             * freeMap;
+   /** Number of free clusters in each FAT page */
+   uint16_t             * freeCount;
+   /** Total number of free clusters */
+   uint32_t               nFreeClusters;
+   /** Extent map cache, indexed by first cluster */
+   fatx_extent_map      * extentCache[EXTENT_CACHE_SIZE];
+   /** Path lookup cache, indexed by a hash of the parent and name */
+   fatx_dcache_entry      dcache[DCACHE_SIZE];
+   /** Directory name indexes */
+   fatx_dir_index       * dirIndexes[DIR_INDEX_CACHE_SIZE];
+   /** Bytes used by the directory name indexes */
+   size_t                 dirIndexMem;
+   /** Bytes the directory name indexes may use */
+   size_t                 dirIndexBudget;
+   /** Access clock of the directory name indexes */
+   uint64_t               dirIndexClock;
+   /** First cluster of the last directory too big for the index budget */
+   uint32_t               dirIndexRejected;
+   /** Directory Bloom filters; they outlive evicted name indexes */
+   fatx_dir_bloom       * dirBlooms[DIR_BLOOM_CACHE_SIZE];
+   /** Bumped whenever a cluster chain is cut short or freed, which makes
+       every cursor stale */
+   uint32_t               chainGen;
+   /** Number of dirty clusters in the cluster cache, updated atomically */
+   uint32_t               nDirty;
+   /** Time the oldest unflushed change was made; 0 when everything is clean */
+   time_t                 dirtySince;
+   /** Number of dirty clusters that wakes the background flusher */
+   uint32_t               dirtyThreshold;
+   /** Background flusher thread */
+   pthread_t              flusher;
+   /** Whether the background flusher thread is running */
+   char                   flusherRunning;
+   /** Tells the background flusher to exit */
+   char                   flusherStop;
+   /** Set under flushLock when the dirty threshold is reached */
+   char                   flushWanted;
+   /** Signalled to wake the background flusher */
+   pthread_cond_t         flushCond;
 } fatx_handle;
 
-/** Filename linked list */
-typedef struct fatx_filename_list {
-   /** Filename. Limited to 42 characters. */
-   char                        filename[43];
-   struct fatx_filename_list * next;
-} fatx_filename_list;
+/** Position in a file's cluster chain, remembered between calls */
+typedef struct fatx_cursor {
+   /** Value of the chain generation the cursor was taken at */
+   uint32_t        chainGen;
+   /** Index within the file of the cluster */
+   uint32_t        fileClusterNo;
+   /** The cluster; 0 when the cursor is unset */
+   uint32_t        clusterNo;
+   /** Number of contiguous clusters starting at clusterNo */
+   uint32_t        runLength;
+} fatx_cursor;
+
+/** Open file */
+typedef struct fatx_file {
+   /** The fatx object the file belongs to */
+   fatx_handle        * fatx_h;
+   /** Location of the file's directory entry */
+   fatx_dirent_loc      loc;
+   /** Set once the file is removed; the entry and its clusters may since
+       belong to another file */
+   char                 stale;
+   /** Neighbours in the fatx object's list of open files */
+   struct fatx_file   * prev;
+   struct fatx_file   * next;
+   /** Lock for the cursor and the write buffer */
+   pthread_mutex_t      lock;
+   /** Where the last call left off */
+   fatx_cursor          cursor;
+   /** Staged appends, up to the end of a cluster; NULL until the first */
+   char               * writeBuf;
+   /** File offset of the staged data, which is where the next append is
+       expected when nothing is staged */
+   off_t                writeOffset;
+   /** Number of bytes staged */
+   uint32_t             writeLen;
+} fatx_file;
+
+/** Iterator over the components of a path, viewed in place */
+typedef struct fatx_path_iter {
+   /** Rest of the path */
+   const char * pos;
+   /** End of the path */
+   const char * end;
+   /** Current component; not NUL terminated */
+   const char * name;
+   /** Length of the current component */
+   size_t       nameLen;
+} fatx_path_iter;
 
 /** fatx_dirent_t linked list */
 typedef struct fatx_dirent_list {
@@ -170,22 +500,94 @@ typedef struct fatx_dir_iter {
    uint32_t             clusterNo;
    /** Entry number */
    uint32_t             entryNo;
+   /** Copy of the last entry read */
+   fatx_directory_entry entry;
+   /** Location of the last entry read */
+   fatx_dirent_loc      loc;
    /** List of dirents given out */
    fatx_dirent_list *   dirEntList;
+   /** -EIO if the walk stopped on a read error rather than the end */
+   int                  err;
 } fatx_dir_iter;
 
+/** Directory waiting to be walked by fatx_walk() */
+typedef struct fatx_walk_item {
+   /** Path of the directory; empty for the root folder */
+   char *               path;
+   /** The directory's entry */
+   fatx_directory_entry entry;
+} fatx_walk_item;
+
+/**
+ * Work queue of one walker thread. The owner pushes and pops at the tail,
+ * other walkers steal from the head.
+ */
+typedef struct fatx_walk_queue {
+   /** Lock for the queue */
+   pthread_mutex_t  lock;
+   /** Queued directories, from head to tail */
+   fatx_walk_item * items;
+   /** Index of the oldest item */
+   uint32_t         head;
+   /** Index past the newest item */
+   uint32_t         tail;
+   /** Number of items allocated */
+   uint32_t         maxItems;
+} fatx_walk_queue;
+
+/** State of a tree walk shared by its walker threads */
+typedef struct fatx_walk_state {
+   /** The fatx object being walked */
+   fatx_handle *     fatx_h;
+   /** Callback for each entry */
+   fatx_walk_cb_t    callback;
+   /** Argument for the callback */
+   void *            arg;
+   /** Number of walker threads */
+   uint32_t          noThreads;
+   /** One work queue per walker */
+   fatx_walk_queue * queues;
+   /** Lock for the counters below */
+   pthread_mutex_t   lock;
+   /** Signalled when work is queued or the walk ends */
+   pthread_cond_t    changed;
+   /** Directories queued or being walked */
+   uint32_t          noPending;
+   /** Directories queued and not yet taken */
+   uint32_t          noQueued;
+   /** First non-zero callback return or error; stops the walk */
+   int               result;
+} fatx_walk_state;
+
+/** Walker thread's arguments */
+typedef struct fatx_walker {
+   /** The walk */
+   fatx_walk_state * walk;
+   /** Index of the walker's own queue */
+   uint32_t          id;
+} fatx_walker;
+
 /** Check if a directory entry is a folder */
 #define IS_FOLDER(x) ( (x)->attributes & 0x10 )
 
 /** Check if a directory entry is hidden */
 #define IS_HIDDEN(x) ( (x)->attributes & 0x2 )
 
+/** Longest file name */
+#define FATX_MAX_NAME_LEN 42
+
 /** Is a valid (non-deleted) directory entry. */
-#define IS_VALID_ENTRY(x) ( (x)->filenameSz <= 42 )
+#define IS_VALID_ENTRY(x) ( (x)->filenameSz <= FATX_MAX_NAME_LEN )
+
+/** Name length that marks a deleted directory entry */
+#define DELETED_ENTRY 0xE5
 
 /** Check if a cluster is a free cluster */
 #define IS_FREE_CLUSTER(x) ((x) == 0)
 
+/** End of chain marker for the volume's FAT type */
+#define FATX_EOC(x) ( (x)->fatType == FATX32 ? 0xFFFFFFFFU : 0xFFFFU )
+
 /**
  * Calculate the number of clusters in a fatx device.
  *
@@ -194,6 +596,15 @@ typedef struct fatx_dir_iter {
  */
 uint32_t fatx_calcClusters(int dev);
 
+/**
+ * Calculate the size of the FAT, rounded up to a whole FAT page.
+ *
+ * \param fatType the type of fat, 1 for FATX16, 2 for FATX32
+ * \param clusters number of clusters.
+ * \return size of the FAT in bytes.
+ */
+size_t fatx_calcFatSize(int fatType, uint32_t clusters);
+
 /**
  * Calculate the start of the data clusters.
  *
@@ -216,9 +627,10 @@ uint32_t fatx_calcFatPages(off_t dataStart);
  *
  * \param fatx_h the fatx object.
  * \param entryNo the entry to retrieve.
- * \return fatx entry
+ * \param entry set to the fatx entry.
+ * \return 0 on success; -EIO if the FAT page couldn't be read.
  */
-uint32_t fatx_readFatEntry(fatx_handle * fatx_h, uint32_t entryNo);
+int fatx_readFatEntry(fatx_handle * fatx_h, uint32_t entryNo, uint32_t * entry);
 
 /**
  * Find a free cluster starting from the given cluster
@@ -229,21 +641,182 @@ uint32_t fatx_readFatEntry(fatx_handle * fatx_h, uint32_t entryNo);
  */
 uint32_t fatx_findFreeCluster(fatx_handle * fatx_h, uint32_t startingCluster);
 
+/**
+ * Count the free clusters in a row starting at a cluster.
+ *
+ * \param fatx_h the fatx object.
+ * \param clusterNo the cluster to start counting at.
+ * \param max stop counting at this many clusters.
+ * \return number of free clusters in a row, at most max.
+ */
+uint32_t fatx_freeRunLength(fatx_handle * fatx_h, uint32_t clusterNo, uint32_t max);
+
+/**
+ * Find a run of contiguous free clusters, searching from the given cluster
+ * towards the end of the FAT and then wrapping around.
+ *
+ * \param fatx_h the fatx object.
+ * \param startingCluster the cluster to begin the search from.
+ * \param count number of clusters needed.
+ * \return first cluster of the run; 0 if there is no run that long.
+ */
+uint32_t fatx_findFreeRun(fatx_handle * fatx_h, uint32_t startingCluster, uint32_t count);
+
+/**
+ * Find a run of contiguous free clusters for an allocation: the run right
+ * after the given cluster if it is long enough, then a run of exactly the
+ * needed length, then the shortest run that is longer. Without such a run
+ * the longest run is taken. A bounded search only picks among the first
+ * maxRuns runs from the given cluster on.
+ *
+ * \param fatx_h the fatx object.
+ * \param startingCluster the cluster the allocation should follow.
+ * \param count number of clusters needed.
+ * \param maxRuns number of runs to look at; 0 to search the whole FAT.
+ * \param length set to the number of clusters of the run to use, at most
+ *               count.
+ * \return first cluster of the run; 0 if there are no free clusters.
+ */
+uint32_t fatx_findBestFreeRun(fatx_handle * fatx_h, uint32_t startingCluster, uint32_t count,
+                              uint32_t maxRuns, uint32_t * length);
+
+/**
+ * Chain a run of contiguous free clusters together, writing the FAT a page
+ * at a time. The clusters must be free.
+ *
+ * \param fatx_h the fatx object.
+ * \param firstCluster first cluster of the run.
+ * \param count number of clusters in the run.
+ * \param last value for the FAT entry of the last cluster of the run.
+ * \return 0 on success; -EIO if a FAT page couldn't be read, in which case
+ *         none of the run is allocated.
+ */
+int fatx_writeFatRun(fatx_handle * fatx_h, uint32_t firstCluster, uint32_t count,
+                      uint32_t last);
+
+/**
+ * Allocate one run of contiguous clusters, terminated with an end of chain
+ * marker. The run is the one fatx_findBestFreeRun() picks, which may be
+ * shorter than count.
+ *
+ * \param fatx_h the fatx object.
+ * \param startingCluster the cluster the run should follow.
+ * \param count number of clusters wanted.
+ * \param maxRuns number of runs to look at; 0 to search the whole FAT.
+ * \param clusterNo set to the first cluster of the run.
+ * \param length set to the number of clusters allocated.
+ * \return 0 on success; -ENOSPC if there are no free clusters; -EIO if the FAT
+ *         couldn't be read.
+ */
+int fatx_allocRun(fatx_handle * fatx_h, uint32_t startingCluster, uint32_t count,
+                  uint32_t maxRuns, uint32_t * clusterNo, uint32_t * length);
+
+/**
+ * Allocate a new cluster chain, from the best fitting run if there is one
+ * long enough and pieced together from the longest runs otherwise. The
+ * whole FAT is searched, which suits allocations made up front.
+ *
+ * \param fatx_h the fatx object.
+ * \param startingCluster the cluster to begin the search from.
+ * \param count number of clusters needed.
+ * \param firstCluster set to the first cluster of the chain.
+ * \return 0 on success; -ENOSPC if there aren't enough free clusters; -EIO if
+ *         the FAT couldn't be read, in which case nothing is allocated.
+ */
+int fatx_allocClusters(fatx_handle * fatx_h, uint32_t startingCluster, uint32_t count,
+                       uint32_t * firstCluster);
+
+/**
+ * Grow a cluster chain to a number of clusters. The new clusters are
+ * allocated in one go, right after the chain's last cluster if there is
+ * room there.
+ *
+ * \param fatx_h the fatx object.
+ * \param firstCluster first cluster of the chain.
+ * \param count number of clusters the chain should have.
+ * \return 0 on success; -ENOSPC if there aren't enough free clusters; -EIO.
+ */
+int fatx_reserveClusters(fatx_handle * fatx_h, uint32_t firstCluster, uint32_t count);
+
+/**
+ * Free a cluster chain. The chain's runs are cleared in FAT page order, so
+ * each FAT page is fetched and dirtied once. A cached extent map whose last
+ * cluster isn't the end of the chain is ignored and the FAT is walked.
+ *
+ * \param fatx_h the fatx object.
+ * \param firstCluster first cluster of the chain.
+ * \return 0 on success; -EIO if part of the FAT couldn't be read, in which
+ *         case the clusters on it stay allocated.
+ */
+int fatx_freeChain(fatx_handle * fatx_h, uint32_t firstCluster);
+
+/**
+ * Clear the FAT entries of a set of cluster runs, a FAT page at a time.
+ * The runs are sorted in place.
+ *
+ * \param fatx_h the fatx object.
+ * \param runs the runs to free.
+ * \param noRuns number of runs.
+ * \return 0 on success; -EIO if a FAT page couldn't be read, in which case
+ *         the clusters on it stay allocated.
+ */
+int fatx_clearFatRuns(fatx_handle * fatx_h, fatx_extent * runs, uint32_t noRuns);
+
+/**
+ * Cut a cluster chain down to a number of clusters and free the rest. A
+ * chain always keeps its first cluster.
+ *
+ * \param fatx_h the fatx object.
+ * \param firstCluster first cluster of the chain.
+ * \param count number of clusters to keep.
+ * \return 0 on success; -EBADF if the chain is broken; -EIO.
+ */
+int fatx_truncateChain(fatx_handle * fatx_h, uint32_t firstCluster, uint32_t count);
+
+/**
+ * Scan the free cluster bitmap for a free cluster in [from, to).
+ *
+ * \param fatx_h the fatx object.
+ * \param from first cluster to consider.
+ * \param to cluster to stop the search at.
+ * \return free cluster number; 0 if there is none in the range.
+ */
+uint32_t fatx_scanFreeMap(fatx_handle * fatx_h, uint32_t from, uint32_t to);
+
+/**
+ * Build the free cluster bitmap and per page free counts from the FAT.
+ *
+ * \param fatx_h the fatx object.
+ * \return 0 on success; -1 on error.
+ */
+int fatx_buildFreeMap(fatx_handle * fatx_h);
+
+/**
+ * Record whether a cluster is free in the free cluster bitmap.
+ *
+ * \param fatx_h the fatx object.
+ * \param clusterNo the cluster.
+ * \param isFree whether the cluster is now free.
+ */
+void fatx_setClusterFree(fatx_handle * fatx_h, uint32_t clusterNo, char isFree);
+
 /**
  * Write a FAT entry
  *
  * \param fatx_h the fatx object.
  * \param entryNo the entry to write.
  * \param value the value to write into the FAT
+ * \return 0 on success; -EIO if the FAT page couldn't be read.
  */
-void fatx_writeFatEntry(fatx_handle * fatx_h, uint32_t entryNo, uint32_t value);
+int fatx_writeFatEntry(fatx_handle * fatx_h, uint32_t entryNo, uint32_t value);
 
 /**
- * Get a FAT page cache entry.
+ * Get a FAT page cache entry. The caller must hold fatLock.
  *
  * \param fatx_h the fatx object.
  * \param pageNo the FAT page to get.
- * \return FAT cache entry corresponding to the requested page.
+ * \return FAT cache entry corresponding to the requested page; NULL if the
+ *         page couldn't be read.
  */
 fatx_fat_cache_entry * fatx_getFatPage(fatx_handle * fatx_h, uint32_t pageNo);
 
@@ -260,104 +833,814 @@ char fatx_isEOC(fatx_handle * fatx_h, uint32_t clusterNo);
  *
  * \param fatx_h the fatx object.
  * \param pageNo FAT page to load into the cache.
+ * \return 0 on success; -EIO if the read failed, in which case the cache
+ *         entry holds no page.
+ */
+int fatx_loadFatPage(fatx_handle * fatx_h, uint32_t pageNo);
+
+/**
+ * Read the whole FAT into memory, converting the entries to host order.
+ *
+ * \param fatx_h the fatx object.
+ * \return 0 on success; -1 on error.
+ */
+int fatx_loadResidentFat(fatx_handle * fatx_h);
+
+/**
+ * Write the dirty pages of the resident FAT out to disk. Consecutive dirty
+ * pages are written together. The caller must hold fatLock.
+ *
+ * \param fatx_h the fatx object.
+ * \return 0 on success; -ENOMEM; -EIO if a write failed, in which case its
+ *         pages stay dirty.
  */
-void fatx_loadFatPage(fatx_handle * fatx_h, uint32_t pageNo);
+int fatx_flushResidentFat(fatx_handle * fatx_h);
 
 /**
  * Flush the contents of a FAT cache entry out to disk.
  *
  * \param fatx_h the fatx object.
  * \param cacheEntry the cache entry to flush
+ * \return 0 on success; -EIO if the write failed, in which case the entry
+ *         stays dirty.
  */
-void fatx_flushFatCacheEntry(fatx_handle * fatx_h, fatx_fat_cache_entry * cacheEntry);
+int fatx_flushFatCacheEntry(fatx_handle * fatx_h, fatx_fat_cache_entry * cacheEntry);
 
 /**
- * Get a cached cluster
+ * Get a cached cluster. The entry stays pinned in the cache until it is
+ * released with fatx_releaseCluster().
  *
  * \param fatx_h the fatx object.
  * \param clusterNo cluster number to get.
- * \return cache entry corresponding to the requested cluster.
+ * \return cache entry corresponding to the requested cluster; NULL if the
+ *         cluster couldn't be read.
  */
 fatx_cache_entry * fatx_getCluster(fatx_handle * fatx_h, uint32_t clusterNo);
 
+/**
+ * Release a cache entry pinned by fatx_getCluster() or fatx_lookupCluster().
+ *
+ * \param fatx_h the fatx object.
+ * \param cacheEntry the cache entry to release.
+ */
+void fatx_releaseCluster(fatx_handle * fatx_h, fatx_cache_entry * cacheEntry);
+
+/**
+ * Look up a cluster in the cache without loading it. A found entry is
+ * pinned like with fatx_getCluster().
+ *
+ * \param fatx_h the fatx object.
+ * \param clusterNo cluster number to look up.
+ * \return cache entry holding the cluster; NULL if it isn't cached.
+ */
+fatx_cache_entry * fatx_lookupCluster(fatx_handle * fatx_h, uint32_t clusterNo);
+
+/**
+ * Read contiguous clusters from disk straight into a buffer, bypassing the cache.
+ *
+ * \param fatx_h the fatx object.
+ * \param clusterNo first cluster to read.
+ * \param count number of clusters to read.
+ * \param buf buffer of at least count clusters.
+ * \return 0 on success; negative error code on failure.
+ */
+int fatx_readClusters(fatx_handle * fatx_h, uint32_t clusterNo, uint32_t count, char * buf);
+
+/**
+ * Map the image file into memory.
+ *
+ * \param fatx_h the fatx object.
+ * \return 0 on success; -1 if the device can't be mapped.
+ */
+int fatx_mapImage(fatx_handle * fatx_h);
+
+/**
+ * Get a pointer into the image mapping.
+ *
+ * \param fatx_h the fatx object.
+ * \param offset device offset.
+ * \param len number of bytes needed at the offset.
+ * \return pointer to the mapped bytes; NULL if not mapped or out of range.
+ */
+char * fatx_mapped(fatx_handle * fatx_h, off_t offset, size_t len);
+
+/**
+ * Pass an madvise() hint for a range of the image mapping. The range is
+ * widened to whole pages; nothing happens when the image isn't mapped.
+ *
+ * \param fatx_h the fatx object.
+ * \param offset device offset of the range.
+ * \param len length of the range.
+ * \param advice the madvise() advice.
+ */
+void fatx_adviseMapped(fatx_handle * fatx_h, off_t offset, size_t len, int advice);
+
+/**
+ * Tell the kernel a range of the device will be read soon. Uses madvise()
+ * on a mapped image and the platform's read advisory on the descriptor
+ * otherwise.
+ *
+ * \param fatx_h the fatx object.
+ * \param offset device offset of the range.
+ * \param len length of the range.
+ */
+void fatx_adviseRead(fatx_handle * fatx_h, off_t offset, size_t len);
+
+/**
+ * Read from the device at an offset, retrying short and interrupted reads.
+ * Anything past the end of the device reads as zeros.
+ *
+ * \param fatx_h the fatx object.
+ * \param buf buffer to read into.
+ * \param len number of bytes to read.
+ * \param offset device offset to read from.
+ * \return 0 on success; -EIO on failure.
+ */
+int fatx_devRead(fatx_handle * fatx_h, void * buf, size_t len, off_t offset);
+
+/**
+ * Write to the device at an offset, retrying short and interrupted writes.
+ *
+ * \param fatx_h the fatx object.
+ * \param buf buffer to write.
+ * \param len number of bytes to write.
+ * \param offset device offset to write to.
+ * \return 0 on success; -EIO on failure.
+ */
+int fatx_devWrite(fatx_handle * fatx_h, const void * buf, size_t len, off_t offset);
+
+/**
+ * Copy a range of the device to another, non-overlapping range. Where the
+ * kernel has copy_file_range() the data stays in the kernel; otherwise,
+ * or if the kernel refuses, it is read and written COPY_CHUNK_SZ at a
+ * time.
+ *
+ * \param fatx_h the fatx object.
+ * \param from device offset to copy from.
+ * \param to device offset to copy to.
+ * \param len number of bytes to copy.
+ * \return 0 on success; -ENOMEM; -EIO.
+ */
+int fatx_devCopy(fatx_handle * fatx_h, off_t from, off_t to, size_t len);
+
+/**
+ * Copy contiguous clusters to another run of clusters. Clusters that are
+ * cached on either side go through the cache, since it may be newer than
+ * the disk; the rest are copied on the device, or in the mapping of a
+ * mapped image.
+ *
+ * \param fatx_h the fatx object.
+ * \param from first cluster to copy.
+ * \param to first cluster to copy into.
+ * \param count number of clusters.
+ * \return 0 on success; negative error code on failure.
+ */
+int fatx_copyClusters(fatx_handle * fatx_h, uint32_t from, uint32_t to, uint32_t count);
+
+/**
+ * Copy the clusters of one chain into another, a run at a time.
+ *
+ * \param fatx_h the fatx object.
+ * \param from first cluster of the chain to copy.
+ * \param to first cluster of the chain to copy into, which must be at least
+ *           as long.
+ * \param count number of clusters to copy.
+ * \return 0 on success; -EBADF if a chain is too short; a copy error.
+ */
+int fatx_copyChain(fatx_handle * fatx_h, uint32_t from, uint32_t to, uint32_t count);
+
 /**
  * Read a cluster from disk
  *
  * \param fatx_h the fatx object.
+ * \param cacheEntry the cache entry to read the cluster into.
  * \param clusterNo cluster to read.
+ * \return 0 on success; -EIO if the read failed, in which case the entry is
+ *         left invalid.
  */
-void fatx_loadCluster(fatx_handle * fatx_h, uint32_t clusterNo);
+int fatx_loadCluster(fatx_handle * fatx_h, fatx_cache_entry * cacheEntry,
+                     uint32_t clusterNo);
 
 /**
  * Write a cluster out to disk
  *
  * \param fatx_h the fatx object.
  * \param cacheEntry the cache entry to flush out to disk
+ * \return 0 on success; -EIO if the write failed, in which case the entry
+ *         stays dirty.
  */
-void fatx_flushClusterCacheEntry(fatx_handle * fatx_h, fatx_cache_entry * cacheEntry);
+int fatx_flushClusterCacheEntry(fatx_handle * fatx_h, fatx_cache_entry * cacheEntry);
 
 /**
- * Free a filename list
+ * Get the extent map of a cluster chain, building it from the FAT when
+ * it isn't cached. The caller must hold extentLock.
  *
- * \param fnList Filename list to free.
+ * \param fatx_h the fatx object.
+ * \param firstCluster first cluster of the chain.
+ * \return the extent map; NULL on error.
  */
-void fatx_freeFilenameList(fatx_filename_list * fnList);
+fatx_extent_map * fatx_getExtentMap(fatx_handle * fatx_h, uint32_t firstCluster);
 
 /**
- * Split a path.
+ * Map a cluster index within a file to a cluster on disk.
  *
- * \param path the path to split.
- * \return list of the path pieces.
+ * \param fatx_h the fatx object.
+ * \param firstCluster first cluster of the file.
+ * \param fileClusterNo index of the cluster within the file.
+ * \param runLength set to the number of contiguous clusters starting at the
+ *                  returned one; may be NULL.
+ * \return the cluster number; 0 if the chain is shorter than fileClusterNo.
  */
-fatx_filename_list * fatx_splitPath(const char * path);
+uint32_t fatx_mapCluster(fatx_handle * fatx_h, uint32_t firstCluster,
+                         uint32_t fileClusterNo, uint32_t * runLength);
 
 /**
- * Grab the basename from a filename list split path.
+ * Map a cluster index within a file to a cluster on disk, starting from a
+ * cursor when it is still valid and covers the cluster.
  *
- * \param fnList filename list path.
- * \return basename filename list element.
+ * \param fatx_h the fatx object.
+ * \param firstCluster first cluster of the file.
+ * \param cursor a cursor into the file; may be NULL.
+ * \param fileClusterNo index of the cluster within the file.
+ * \param runLength set to the number of contiguous clusters starting at the
+ *                  returned one.
+ * \return the cluster number; 0 if the chain is shorter than fileClusterNo.
  */
-fatx_filename_list * fatx_basename(fatx_filename_list * fnList);
+uint32_t fatx_seekCluster(fatx_handle * fatx_h, uint32_t firstCluster,
+                          fatx_cursor * cursor, uint32_t fileClusterNo,
+                          uint32_t * runLength);
 
 /**
- * Get the dirname from a filename list split path.
+ * Move a cursor to a cluster.
  *
- * \param fnList filename list.
- * \param dirname filename list.
+ * \param fatx_h the fatx object.
+ * \param cursor the cursor; may be NULL.
+ * \param fileClusterNo index of the cluster within the file.
+ * \param clusterNo the cluster.
+ * \param runLength number of contiguous clusters starting at clusterNo.
  */
-fatx_filename_list * fatx_dirname(fatx_filename_list * fnList);
+void fatx_setCursor(fatx_handle * fatx_h, fatx_cursor * cursor, uint32_t fileClusterNo,
+                    uint32_t clusterNo, uint32_t runLength);
+
+/**
+ * Track sequential access to a file and issue read-ahead for it. A read
+ * that continues where the last one stopped doubles the window, starting
+ * at READAHEAD_MIN and capped at READAHEAD_MAX clusters; any other read
+ * closes it. Read-ahead covers the window past the end of this read.
+ *
+ * \param fatx_h the fatx object.
+ * \param firstCluster first cluster of the file.
+ * \param fileClusterNo first file cluster of the read.
+ * \param endClusterNo file cluster holding the byte after the read.
+ */
+void fatx_readahead(fatx_handle * fatx_h, uint32_t firstCluster,
+                    uint32_t fileClusterNo, uint32_t endClusterNo);
+
+/**
+ * Hint to the kernel that part of a cluster chain will be read soon. The
+ * chain is resolved through its extent map, and at most READAHEAD_MAX_RUNS
+ * contiguous runs are hinted.
+ *
+ * \param fatx_h the fatx object.
+ * \param firstCluster first cluster of the chain.
+ * \param fileClusterNo first cluster in the chain to hint.
+ * \param count number of clusters to hint.
+ */
+void fatx_prefetchChain(fatx_handle * fatx_h, uint32_t firstCluster,
+                        uint32_t fileClusterNo, uint32_t count);
+
+/**
+ * Append a run of clusters to an extent map, extending the last extent when
+ * the run follows it on disk.
+ *
+ * \param map the extent map.
+ * \param clusterNo first cluster of the run.
+ * \param length number of clusters in the run.
+ * \return 0 on success; -1 on allocation failure.
+ */
+int fatx_appendExtent(fatx_extent_map * map, uint32_t clusterNo, uint32_t length);
+
+/**
+ * Record a run appended to the end of a chain in its cached extent map.
+ *
+ * \param fatx_h the fatx object.
+ * \param firstCluster first cluster of the chain.
+ * \param clusterNo first cluster of the appended run.
+ * \param length number of clusters in the appended run.
+ */
+void fatx_extendExtentMap(fatx_handle * fatx_h, uint32_t firstCluster, uint32_t clusterNo,
+                          uint32_t length);
+
+/**
+ * Drop the cached extent map of a chain.
+ *
+ * \param fatx_h the fatx object.
+ * \param firstCluster first cluster of the chain.
+ */
+void fatx_invalidateExtentMap(fatx_handle * fatx_h, uint32_t firstCluster);
+
+/**
+ * Mark a cached cluster as dirty.
+ *
+ * \param fatx_h the fatx object.
+ * \param cacheEntry the cache entry that was modified.
+ */
+void fatx_markClusterDirty(fatx_handle * fatx_h, fatx_cache_entry * cacheEntry);
+
+/**
+ * Note that in memory state was modified, starting the dirty age clock.
+ *
+ * \param fatx_h the fatx object.
+ */
+void fatx_noteDirty(fatx_handle * fatx_h);
+
+/**
+ * Write a vector of buffers to the device, retrying short writes.
+ *
+ * \param fatx_h the fatx object.
+ * \param iov buffers to write. Modified as the write progresses.
+ * \param iovcnt number of buffers.
+ * \param offset device offset to write to.
+ * \return 0 on success; negative error code on failure.
+ */
+int fatx_writeVector(fatx_handle * fatx_h, struct iovec * iov, int iovcnt, off_t offset);
+
+/**
+ * Order cache entry pointers by cluster number, for qsort.
+ */
+int fatx_compareClusterEntries(const void * a, const void * b);
+
+/**
+ * Order FAT cache entry pointers by page number, for qsort.
+ */
+int fatx_compareFatEntries(const void * a, const void * b);
+
+/**
+ * Order extents by cluster number, for qsort.
+ */
+int fatx_compareExtents(const void * a, const void * b);
+
+/**
+ * Write all dirty clusters and FAT pages out to disk. Dirty entries are
+ * sorted by device offset and adjacent ones are merged into single
+ * vectored writes. The metadata lock must be held, shared is enough.
+ *
+ * \param fatx_h the fatx object.
+ * \return 0 on success; the first error otherwise. Whatever failed to be
+ *         written stays dirty for the next flush.
+ */
+int fatx_flush(fatx_handle * fatx_h);
+
+/**
+ * Background flusher thread body. Flushes when the dirty cluster count
+ * reaches the threshold or the oldest change is older than the flush interval.
+ *
+ * \param arg the fatx object.
+ * \return NULL
+ */
+void * fatx_flusherMain(void * arg);
+
+/**
+ * Free an extent map.
+ *
+ * \param map the extent map to free.
+ */
+void fatx_freeExtentMap(fatx_extent_map * map);
+
+
+/**
+ * Start iterating over the components of a path.
+ *
+ * \param iter the iterator.
+ * \param path the path; need not be NUL terminated.
+ * \param pathLen length of the path.
+ */
+void fatx_initPathIter(fatx_path_iter * iter, const char * path, size_t pathLen);
+
+/**
+ * Move a path iterator to the next component. Repeated slashes are
+ * skipped, so "/a//b/" has the components "a" and "b".
+ *
+ * \param iter the iterator.
+ * \return 1 if iter->name is set to the next component; 0 at the end of the
+ *         path; -ENAMETOOLONG if the component is too long for FATX.
+ */
+int fatx_nextPathComponent(fatx_path_iter * iter);
+
+/**
+ * Split a path into its dirname and basename, checking every component.
+ * The dirname is the first dirLen bytes of the path.
+ *
+ * \param path the path to split; NULL for the root directory.
+ * \param dirLen set to the length of the dirname.
+ * \param basename set to the last component; NULL for the root directory.
+ * \param baseLen set to the length of the last component.
+ * \return 0 on success; -ENAMETOOLONG if a component is too long.
+ */
+int fatx_splitPath(const char * path, size_t * dirLen, const char ** basename,
+                   size_t * baseLen);
 
 /**
  * Create a dir iterator.
  *
  * \param fatx_h the fatx object.
  * \param directoryEntry base directory entry, NULL for the root folder.
- * \return the dir iterator.
+ * \return the dir iterator; NULL if the entry isn't a folder.
  */
 fatx_dir_iter * fatx_createDirIter(fatx_handle *          fatx_h, 
                                    fatx_directory_entry * directoryEntry);
 
 /**
- * Read a directory entry from an iterator
+ * Initialize a dir iterator in place.
+ *
+ * \param fatx_h the fatx object.
+ * \param iter the iterator to initialize.
+ * \param directoryEntry base directory entry, NULL for the root folder.
+ * \return 0 on success; -ENOTDIR if the entry isn't a folder.
+ */
+int fatx_initDirIter(fatx_handle * fatx_h, fatx_dir_iter * iter,
+                     fatx_directory_entry * directoryEntry);
+
+/**
+ * Read a directory entry from an iterator. The entry is copied into the
+ * iterator along with its location.
  *
  * \param fatx_h the fatx object.
  * \param iter the iterator.
- * \return directory entry; NULL if no entries left.
+ * \return the iterator's copy of the directory entry; NULL if no entries left
+ *         or on a read error, which is left in the iterator's err.
  */
 fatx_directory_entry * fatx_readDirectoryEntry(fatx_handle * fatx_h,
                                                fatx_dir_iter * iter);
 
+/**
+ * Read the next valid directory entry from an iterator, or with a name the
+ * next entry with that name. Deleted entries are skipped, and each cluster
+ * is searched with the scan kernels in one go.
+ *
+ * \param fatx_h the fatx object.
+ * \param iter the iterator.
+ * \param name name to look for, NULL for any valid entry; need not be NUL
+ *             terminated.
+ * \param nameLen length of the name.
+ * \return the iterator's copy of the directory entry; NULL if no entries left
+ *         or on a read error, which is left in the iterator's err.
+ */
+fatx_directory_entry * fatx_scanDirectory(fatx_handle * fatx_h, fatx_dir_iter * iter,
+                                          const char * name, size_t nameLen);
+
+/**
+ * Fill in a directory entry with attributes from an on-disk entry.
+ *
+ * \param fatx_h the fatx object.
+ * \param directoryEntry the on-disk directory entry.
+ * \param entry set to the entry's name and attributes.
+ */
+void fatx_fillDirentPlus(fatx_handle * fatx_h, fatx_directory_entry * directoryEntry,
+                         fatx_dirent_plus_t * entry);
+
+/**
+ * Read the directory entry at a location.
+ *
+ * \param fatx_h the fatx object.
+ * \param loc location of the directory entry.
+ * \param directoryEntry set to a copy of the directory entry.
+ * \return 0 on success; -EIO if the entry couldn't be read.
+ */
+int fatx_loadDirectoryEntry(fatx_handle * fatx_h, fatx_dirent_loc * loc,
+                            fatx_directory_entry * directoryEntry);
+
+/**
+ * Read the directory entry of an open file. The metadata lock must be held.
+ *
+ * \param file the open file.
+ * \param directoryEntry set to a copy of the directory entry.
+ * \return 0 on success; -ESTALE if the file was removed; -EIO.
+ */
+int fatx_loadOpenEntry(fatx_file * file, fatx_directory_entry * directoryEntry);
+
+/**
+ * Mark the open files of a directory entry stale, before the entry is
+ * removed. The metadata write lock must be held.
+ *
+ * \param fatx_h the fatx object.
+ * \param loc location of the directory entry.
+ */
+void fatx_markStale(fatx_handle * fatx_h, fatx_dirent_loc * loc);
+
+/**
+ * Stage an append in an open file's write buffer. Only as much as fits
+ * before the end of the cluster the staged data is in is taken. The file's
+ * lock must be held.
+ *
+ * \param file the open file.
+ * \param buf data to append.
+ * \param size number of bytes to append.
+ * \return the number of bytes staged; -ENOMEM.
+ */
+int fatx_stageWrite(fatx_file * file, const char * buf, size_t size);
+
+/**
+ * Write out the data staged in an open file's write buffer and empty it.
+ * The file's lock and the metadata write lock must be held.
+ *
+ * \param file the open file.
+ * \return 0 on success; -ESTALE if the file was removed; a write error.
+ */
+int fatx_writeStaged(fatx_file * file);
+
 /**
  * Find a directory entry
  *
  * \param fatx_h the fatx object.
- * \param fnList the split path to the directory entry.
+ * \param path path to the directory entry, relative to the base; need not be
+ *             NUL terminated.
+ * \param pathLen length of the path.
  * \param baseDirectoryEntry the base directory entr to start the search in; NULL for the root directory.
- * \return the requested directory entry or NULL if not found.
+ * \param result set to a copy of the directory entry.
+ * \param loc set to the location of the directory entry. Left alone if the path is empty
+ *            and a base directory entry is given.
+ * \return 0 on success; negative error code if not found.
+ */
+int fatx_findDirectoryEntry(fatx_handle *          fatx_h,
+                            const char *           path,
+                            size_t                 pathLen,
+                            fatx_directory_entry * baseDirectoryEntry,
+                            fatx_directory_entry * result,
+                            fatx_dirent_loc *      loc);
+
+/**
+ * Check a directory entry's name. Names match only if they have the same
+ * length, so one name being a prefix of another doesn't count.
+ *
+ * \param directoryEntry the directory entry.
+ * \param name the name to compare with; need not be NUL terminated.
+ * \param nameLen length of the name.
+ * \return 1 if the entry has the name; 0 otherwise.
+ */
+int fatx_nameMatches(fatx_directory_entry * directoryEntry, const char * name,
+                     size_t nameLen);
+
+/**
+ * Hash a name.
+ *
+ * \param name the name.
+ * \param nameLen length of the name.
+ * \return the 32 bit FNV-1a hash of the name.
  */
-fatx_directory_entry * fatx_findDirectoryEntry(fatx_handle *          fatx_h,
-                                               fatx_filename_list *   fnList,
-                                               fatx_directory_entry * baseDirectoryEntry);
+uint32_t fatx_hashName(const char * name, size_t nameLen);
+
+/**
+ * Hash a name within a directory to its path lookup cache slot.
+ *
+ * \param parentCluster first cluster of the directory.
+ * \param name the name.
+ * \param nameLen length of the name.
+ * \return the slot number.
+ */
+uint32_t fatx_dcacheHash(uint32_t parentCluster, const char * name, size_t nameLen);
+
+/**
+ * Look a name up in the path lookup cache. A positive hit is checked
+ * against the directory entry it points to before it is returned.
+ *
+ * \param fatx_h the fatx object.
+ * \param parentCluster first cluster of the directory.
+ * \param name the name.
+ * \param nameLen length of the name.
+ * \param result set to a copy of the directory entry on a hit.
+ * \param loc set to the location of the directory entry on a hit.
+ * \return 0 on a hit; -ENOENT if the name is cached as missing; 1 on a miss;
+ *         -EIO if the entry couldn't be read.
+ */
+int fatx_dcacheLookup(fatx_handle * fatx_h, uint32_t parentCluster,
+                      const char * name, size_t nameLen,
+                      fatx_directory_entry * result, fatx_dirent_loc * loc);
+
+/**
+ * Record the result of a lookup in the path lookup cache, replacing
+ * whatever was cached for the name before.
+ *
+ * \param fatx_h the fatx object.
+ * \param parentCluster first cluster of the directory.
+ * \param name the name.
+ * \param nameLen length of the name.
+ * \param loc location of the directory entry; NULL to record that the name
+ *            doesn't exist.
+ */
+void fatx_dcacheInsert(fatx_handle * fatx_h, uint32_t parentCluster,
+                       const char * name, size_t nameLen, fatx_dirent_loc * loc);
+
+/**
+ * Drop everything cached for a directory from the path lookup cache. Used
+ * when a directory goes away, since its first cluster may be reused.
+ *
+ * \param fatx_h the fatx object.
+ * \param parentCluster first cluster of the directory.
+ */
+void fatx_dcachePurgeDir(fatx_handle * fatx_h, uint32_t parentCluster);
+
+/**
+ * Get the name index of a directory, scanning the directory to build it
+ * if there is none. Building may evict the least recently used indexes to
+ * stay within the memory budget. The caller must hold dirIndexLock.
+ *
+ * \param fatx_h the fatx object.
+ * \param folder the directory entry of the directory.
+ * \return the index; NULL if it can't be built or doesn't fit the budget.
+ */
+fatx_dir_index * fatx_getDirIndex(fatx_handle * fatx_h, fatx_directory_entry * folder);
+
+/**
+ * Add a slot to a directory name index, growing it when it gets too full.
+ * The caller must hold dirIndexLock.
+ *
+ * \param fatx_h the fatx object.
+ * \param index the index.
+ * \param hash hash of the name.
+ * \param loc location of the directory entry.
+ * \return 0 on success; -ENOMEM if the index couldn't grow.
+ */
+int fatx_dirIndexAdd(fatx_handle * fatx_h, fatx_dir_index * index, uint32_t hash,
+                     fatx_dirent_loc * loc);
+
+/**
+ * Remember a deleted entry of a directory for reuse. The caller must hold
+ * dirIndexLock.
+ *
+ * \param fatx_h the fatx object.
+ * \param index the index of the directory.
+ * \param loc location of the deleted entry.
+ * \return 0 on success; -ENOMEM if the free slot list couldn't grow.
+ */
+int fatx_dirIndexAddFreeSlot(fatx_handle * fatx_h, fatx_dir_index * index,
+                             fatx_dirent_loc * loc);
+
+/**
+ * Get the memory used by a directory name index.
+ *
+ * \param index the index.
+ * \return the size in bytes.
+ */
+size_t fatx_dirIndexSize(fatx_dir_index * index);
+
+/**
+ * Look a name up through the directory's name index.
+ *
+ * \param fatx_h the fatx object.
+ * \param folder the directory entry of the directory.
+ * \param name the name.
+ * \param nameLen length of the name.
+ * \param result set to a copy of the directory entry when found.
+ * \param loc set to the location of the directory entry when found.
+ * \return 0 if found; -ENOENT if not; 1 if the directory has no index; -EIO if
+ *         a candidate entry couldn't be read.
+ */
+int fatx_dirIndexLookup(fatx_handle * fatx_h, fatx_directory_entry * folder,
+                        const char * name, size_t nameLen,
+                        fatx_directory_entry * result, fatx_dirent_loc * loc);
+
+/**
+ * Add a new directory entry to its directory's name index and Bloom
+ * filter, if the directory has them, and take its slot off the free slots
+ * or move the end of the directory past it. An index that can't take the
+ * entry is dropped.
+ *
+ * \param fatx_h the fatx object.
+ * \param parentCluster first cluster of the directory.
+ * \param name the name.
+ * \param nameLen length of the name.
+ * \param loc location of the new directory entry.
+ */
+void fatx_dirIndexInsert(fatx_handle * fatx_h, uint32_t parentCluster,
+                         const char * name, size_t nameLen, fatx_dirent_loc * loc);
+
+/**
+ * Remove a directory entry from its directory's name index, if the
+ * directory has one, and remember its slot for reuse.
+ *
+ * \param fatx_h the fatx object.
+ * \param parentCluster first cluster of the directory.
+ * \param name the name.
+ * \param nameLen length of the name.
+ * \param loc location of the removed directory entry.
+ */
+void fatx_dirIndexRemove(fatx_handle * fatx_h, uint32_t parentCluster,
+                         const char * name, size_t nameLen, fatx_dirent_loc * loc);
+
+/**
+ * Drop a directory's name index. The caller must hold dirIndexLock.
+ *
+ * \param fatx_h the fatx object.
+ * \param parentCluster first cluster of the directory.
+ */
+void fatx_dirIndexDrop(fatx_handle * fatx_h, uint32_t parentCluster);
+
+/**
+ * Free a directory name index.
+ *
+ * \param index the index; may be NULL.
+ */
+void fatx_freeDirIndex(fatx_dir_index * index);
+
+/**
+ * Get the cached Bloom filter of a directory. The caller must hold
+ * dirIndexLock.
+ *
+ * \param fatx_h the fatx object.
+ * \param firstCluster first cluster of the directory.
+ * \return the filter; NULL if the directory has none.
+ */
+fatx_dir_bloom * fatx_findDirBloom(fatx_handle * fatx_h, uint32_t firstCluster);
+
+/**
+ * Create an empty Bloom filter for a directory and cache it, evicting the
+ * least recently used filter if the cache is full. The caller must hold
+ * dirIndexLock.
+ *
+ * \param fatx_h the fatx object.
+ * \param firstCluster first cluster of the directory.
+ * \param noNames number of names the filter will hold.
+ * \return the filter; NULL if out of memory.
+ */
+fatx_dir_bloom * fatx_newDirBloom(fatx_handle * fatx_h, uint32_t firstCluster,
+                                  uint32_t noNames);
+
+/**
+ * Give a directory a Bloom filter built from the hashes in its name index,
+ * unless it already has one. The caller must hold dirIndexLock.
+ *
+ * \param fatx_h the fatx object.
+ * \param index the directory's name index.
+ */
+void fatx_dirBloomFromIndex(fatx_handle * fatx_h, fatx_dir_index * index);
+
+/**
+ * Add a name hash to a Bloom filter.
+ *
+ * \param bloom the filter.
+ * \param hash the name's fatx_hashName() hash.
+ */
+void fatx_bloomAdd(fatx_dir_bloom * bloom, uint32_t hash);
+
+/**
+ * Test a name hash against a Bloom filter.
+ *
+ * \param bloom the filter.
+ * \param hash the name's fatx_hashName() hash.
+ * \return 0 if the name is definitely not in the directory; 1 if it may be.
+ */
+int fatx_bloomTest(fatx_dir_bloom * bloom, uint32_t hash);
+
+/**
+ * Check if a name may be in a directory without reading the directory.
+ *
+ * \param fatx_h the fatx object.
+ * \param folder the directory entry of the directory.
+ * \param name the name.
+ * \param nameLen length of the name.
+ * \return -ENOENT if the name is definitely not there; 0 if it may be; 1
+ *         if the directory has no filter.
+ */
+int fatx_dirBloomLookup(fatx_handle * fatx_h, fatx_directory_entry * folder,
+                        const char * name, size_t nameLen);
+
+/**
+ * Add a name to a directory's Bloom filter, if the directory has one. A
+ * filter grown past the number of names it was sized for is dropped, to be
+ * rebuilt larger. The caller must hold dirIndexLock.
+ *
+ * \param fatx_h the fatx object.
+ * \param parentCluster first cluster of the directory.
+ * \param hash the name's fatx_hashName() hash.
+ */
+void fatx_dirBloomAdd(fatx_handle * fatx_h, uint32_t parentCluster, uint32_t hash);
+
+/**
+ * Drop a directory's Bloom filter. The caller must hold dirIndexLock.
+ *
+ * \param fatx_h the fatx object.
+ * \param parentCluster first cluster of the directory.
+ */
+void fatx_dirBloomDrop(fatx_handle * fatx_h, uint32_t parentCluster);
+
+/**
+ * Free a directory Bloom filter.
+ *
+ * \param bloom the filter; may be NULL.
+ */
+void fatx_freeDirBloom(fatx_dir_bloom * bloom);
+
+/**
+ * Write a directory entry back to its location.
+ *
+ * \param fatx_h the fatx object.
+ * \param loc location of the entry; the root entry is never written.
+ * \param directoryEntry the new contents of the entry.
+ * \return 0 on success; -EIO if the entry's cluster couldn't be read.
+ */
+int fatx_writeDirectoryEntry(fatx_handle * fatx_h, fatx_dirent_loc * loc,
+                             fatx_directory_entry * directoryEntry);
 /**
  * Make a time_t based on the time and date values from FATX
  *
@@ -372,6 +1655,8 @@ time_t fatx_makeTimeType(uint16_t date, uint16_t time);
  *
  * \param fatx the fatx object.
  * \param directoryEntry the directory entry of the file to read from.
+ * \param cursor where to start looking for the clusters, updated to the last
+ *               cluster read; may be NULL.
  * \param buf buffer to read file data into.
  * \param offset offset in the file to read from.
  * \param len number of bytes to read from the file.
@@ -379,6 +1664,7 @@ time_t fatx_makeTimeType(uint16_t date, uint16_t time);
  */
 int fatx_readFromDirectoryEntry(fatx_handle * fatx_h, 
                                 fatx_directory_entry * directoryEntry,
+                                fatx_cursor * cursor,
                                 char * buf, off_t offset, size_t len);
 
 /**
@@ -386,32 +1672,53 @@ int fatx_readFromDirectoryEntry(fatx_handle * fatx_h,
  *
  * \param fatx the fatx object.
  * \param directoryEntry the directory entry of the file to write to
+ * \param loc location of the directory entry.
+ * \param cursor where to start looking for the clusters, updated to the last
+ *               cluster written; may be NULL.
  * \param buf buffer to read the data fro.
  * \param offset offset in the file to write to.
  * \param len number of bytes to written to the file.
- * \return number of bytes written or a negative error code.
+ * \return number of bytes written, which is short if the device fills up
+ *         part way; a negative error code if nothing was written.
  */
 int fatx_writeToDirectoryEntry(fatx_handle * fatx_h, 
                                fatx_directory_entry * directoryEntry,
-                               char * buf, off_t offset, size_t len);
+                               fatx_dirent_loc * loc, fatx_cursor * cursor,
+                               const char * buf, off_t offset, size_t len);
 
 /**
  * Initialize a cluster as an empty directory.
  *
  * \param fatx_h the fatx object
  * \param clusterNo the cluster to initialize.
+ * \return 0 on success; -EIO.
+ */
+int fatx_initDirCluster(fatx_handle * fatx_h, uint32_t clusterNo);
+
+/**
+ * Add a cluster to the end of a directory.
+ *
+ * \param fatx_h the fatx object
+ * \param firstCluster the first cluster of the directory.
+ * \param lastCluster the last cluster of the directory.
+ * \param loc set to the first entry of the new cluster.
+ * \return 0 on success; -ENOSPC if the device is full; -EIO.
  */
-void fatx_initDirCluster(fatx_handle * fatx_h, uint32_t clusterNo);
+int fatx_growDirectory(fatx_handle * fatx_h, uint32_t firstCluster, uint32_t lastCluster,
+                       fatx_dirent_loc * loc);
 
 /**
- * Get the next open directory entry in a folder.
+ * Get the next open directory entry in a folder, growing the folder by a
+ * cluster if it is full. Directories with a name index take the slot from
+ * the index's free slots or end hint instead of scanning.
  *
  * \param fatx_h the fatx object
- * \param folder the directory to look in.
- * \return reference to the first empty directory entry.
+ * \param folder the directory to look in, NULL for the root folder.
+ * \param loc set to the location of the first empty directory entry.
+ * \return 0 on success; negative error code on failure.
  */
-fatx_directory_entry * fatx_getFirstOpenDirectoryEntry(fatx_handle * fatx_h,
-                                                       fatx_directory_entry * folder);
+int fatx_getFirstOpenDirectoryEntry(fatx_handle * fatx_h, fatx_directory_entry * folder,
+                                    fatx_dirent_loc * loc);
 
 /**
  * Make a file in the given directory
@@ -419,9 +1726,163 @@ fatx_directory_entry * fatx_getFirstOpenDirectoryEntry(fatx_handle * fatx_h,
  * \param fatx_h the fatx object
  * \param directoryEntry the folder to create the file in.
  * \param filename the name of the file to create.
- * \return error code.
+ * \param filenameLen length of the name.
+ * \param loc set to the location of the new entry; may be NULL.
+ * \return error code; -EEXIST if the name is taken.
  */
 int fatx_mkFileInDirectory(fatx_handle * fatx_h, fatx_directory_entry * directoryEntry,
-                           fatx_filename_list * filename);
+                           const char * filename, size_t filenameLen, fatx_dirent_loc * loc);
+
+/**
+ * Delete a directory entry and free its clusters. Handles open on it go
+ * stale, and nothing cached about it, or about a folder's contents,
+ * outlives it. A folder must be empty. The metadata write lock must be held.
+ *
+ * \param fatx_h the fatx object
+ * \param parentCluster first cluster of the directory holding the entry.
+ * \param loc location of the entry.
+ * \param directoryEntry the entry.
+ * \return 0 on success; -EIO if the entry couldn't be written, in which case
+ *         nothing is deleted, or if some of its clusters couldn't be freed.
+ */
+int fatx_deleteEntry(fatx_handle * fatx_h, uint32_t parentCluster, fatx_dirent_loc * loc,
+                     fatx_directory_entry * directoryEntry);
+
+/**
+ * Queue a directory on a walker's queue.
+ *
+ * \param walk the walk.
+ * \param id index of the queue.
+ * \param path path of the directory; the queue takes ownership of it.
+ * \param entry the directory's entry.
+ * \return 0 on success; -ENOMEM if the queue can't grow.
+ */
+int fatx_walkPush(fatx_walk_state * walk, uint32_t id, char * path,
+                  fatx_directory_entry * entry);
+
+/**
+ * Take a directory to walk, newest first from the walker's own queue, or
+ * else oldest first from another walker's queue.
+ *
+ * \param walk the walk.
+ * \param id index of the walker's queue.
+ * \param item set to the directory taken.
+ * \return 1 if a directory was taken; 0 if all queues are empty.
+ */
+int fatx_walkTake(fatx_walk_state * walk, uint32_t id, fatx_walk_item * item);
+
+/**
+ * Stop a walk, keeping the first reason given.
+ *
+ * \param walk the walk.
+ * \param result the callback's return value or an error code.
+ */
+void fatx_walkStop(fatx_walk_state * walk, int result);
+
+/**
+ * Walk one directory: hand each entry to the callback and queue its
+ * subdirectories. The metadata lock is held only while a batch of entries
+ * is read, never across the callback. The first clusters of subdirectories
+ * are prefetched as they are read, so they are on their way in by the time
+ * a walker takes them.
+ *
+ * \param walk the walk.
+ * \param id index of the walker's queue.
+ * \param item the directory to walk.
+ */
+void fatx_walkDirectory(fatx_walk_state * walk, uint32_t id, fatx_walk_item * item);
+
+/**
+ * Walker thread. Takes directories until none are queued or being walked,
+ * or until the walk is stopped.
+ *
+ * \param arg the walker's fatx_walker.
+ * \return NULL.
+ */
+void * fatx_walkerMain(void * arg);
+
+/**
+ * Pick the directory scan kernels for the CPU.
+ *
+ * \param fatx_h the fatx object.
+ */
+void fatx_initScan(fatx_handle * fatx_h);
+
+/**
+ * Find the first entry in a directory cluster, starting at entryNo, that is
+ * valid or the end of directory marker.
+ *
+ * \param fatx_h the fatx object.
+ * \param entries the cluster's directory entries.
+ * \param entryNo entry to start at.
+ * \return index of the entry; DIR_ENTRIES_PER_CLUSTER if there is none.
+ */
+uint32_t fatx_scanValid(fatx_handle * fatx_h, fatx_directory_entry * entries,
+                        uint32_t entryNo);
+
+/**
+ * Find the first entry in a directory cluster, starting at entryNo, that
+ * may have a name or is the end of directory marker. Candidates match the
+ * name's length and first byte, or with the vector kernels its first two
+ * and last four bytes; the caller compares the whole name.
+ *
+ * \param fatx_h the fatx object.
+ * \param entries the cluster's directory entries.
+ * \param entryNo entry to start at.
+ * \param name the name; need not be NUL terminated.
+ * \param nameLen length of the name, at least 1.
+ * \return index of the entry; DIR_ENTRIES_PER_CLUSTER if there is none.
+ */
+uint32_t fatx_scanName(fatx_handle * fatx_h, fatx_directory_entry * entries,
+                       uint32_t entryNo, const char * name, size_t nameLen);
+
+/** fatx_scanValid() one entry at a time */
+uint32_t fatx_scanValidScalar(fatx_directory_entry * entries, uint32_t entryNo);
+
+/** fatx_scanName() one entry at a time */
+uint32_t fatx_scanNameScalar(fatx_directory_entry * entries, uint32_t entryNo,
+                             const char * name, size_t nameLen);
+
+#if FATX_SCAN_X86
+#include <immintrin.h>
+
+/**
+ * Build the two words the vector kernels compare each entry with: the
+ * name length with the first two bytes of the name, and the last four
+ * bytes of the name.
+ *
+ * \param name the name.
+ * \param nameLen length of the name, at least 1.
+ * \param key set to the two words.
+ * \param mask set to the bits of the two words to compare.
+ * \return offset in the entry of the second word.
+ */
+uint32_t fatx_scanKey(const char * name, size_t nameLen, uint32_t * key, uint32_t * mask);
+
+/**
+ * Gather a word from each of four consecutive directory entries.
+ *
+ * \param entries the first entry.
+ * \param offset offset of the word in each entry, at most 48.
+ * \return the four words, in entry order.
+ */
+__m128i fatx_scanHeads(fatx_directory_entry * entries, uint32_t offset);
+
+/** fatx_scanValid() four entries per compare */
+uint32_t fatx_scanValidSse2(fatx_directory_entry * entries, uint32_t entryNo);
+
+/** fatx_scanName() four entries per compare */
+uint32_t fatx_scanNameSse2(fatx_directory_entry * entries, uint32_t entryNo,
+                           const char * name, size_t nameLen);
+
+/** fatx_scanValid() eight entries per gather */
+__attribute__((target("avx2")))
+uint32_t fatx_scanValidAvx2(fatx_directory_entry * entries, uint32_t entryNo);
+
+/** fatx_scanName() eight entries per gather */
+__attribute__((target("avx2")))
+uint32_t fatx_scanNameAvx2(fatx_directory_entry * entries, uint32_t entryNo,
+                           const char * name, size_t nameLen);
+#endif //FATX_SCAN_X86
 
 #endif // __LIBFATX_INTERNAL_H__
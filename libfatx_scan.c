@@ -0,0 +1,221 @@
+#include <stdint.h>
+#include <string.h>
+#include "libfatx_internal.h"
+
+void
+fatx_initScan(fatx_handle * fatx_h)
+{
+   fatx_h->scanIsa = SCAN_SCALAR;
+#if FATX_SCAN_X86
+   __builtin_cpu_init();
+   fatx_h->scanIsa = __builtin_cpu_supports("avx2") ? SCAN_AVX2 : SCAN_SSE2;
+#endif
+}
+
+uint32_t
+fatx_scanValid(fatx_handle          * fatx_h,
+               fatx_directory_entry * entries,
+               uint32_t               entryNo)
+{
+#if FATX_SCAN_X86
+   if(fatx_h->scanIsa == SCAN_AVX2)
+      return fatx_scanValidAvx2(entries, entryNo);
+   if(fatx_h->scanIsa == SCAN_SSE2)
+      return fatx_scanValidSse2(entries, entryNo);
+#endif
+   return fatx_scanValidScalar(entries, entryNo);
+}
+
+uint32_t
+fatx_scanName(fatx_handle          * fatx_h,
+              fatx_directory_entry * entries,
+              uint32_t               entryNo,
+              const char           * name,
+              size_t                 nameLen)
+{
+#if FATX_SCAN_X86
+   if(fatx_h->scanIsa == SCAN_AVX2)
+      return fatx_scanNameAvx2(entries, entryNo, name, nameLen);
+   if(fatx_h->scanIsa == SCAN_SSE2)
+      return fatx_scanNameSse2(entries, entryNo, name, nameLen);
+#endif
+   return fatx_scanNameScalar(entries, entryNo, name, nameLen);
+}
+
+uint32_t
+fatx_scanValidScalar(fatx_directory_entry * entries,
+                     uint32_t               entryNo)
+{
+   for(; entryNo < DIR_ENTRIES_PER_CLUSTER; entryNo++) {
+      if(IS_VALID_ENTRY(entries + entryNo) || entries[entryNo].filenameSz == 0xFF)
+         break;
+   }
+   return entryNo;
+}
+
+uint32_t
+fatx_scanNameScalar(fatx_directory_entry * entries,
+                    uint32_t               entryNo,
+                    const char           * name,
+                    size_t                 nameLen)
+{
+   for(; entryNo < DIR_ENTRIES_PER_CLUSTER; entryNo++) {
+      if(entries[entryNo].filenameSz == 0xFF ||
+         (entries[entryNo].filenameSz == nameLen && entries[entryNo].filename[0] == name[0]))
+         break;
+   }
+   return entryNo;
+}
+
+#if FATX_SCAN_X86
+
+uint32_t
+fatx_scanKey(const char * name,
+             size_t       nameLen,
+             uint32_t   * key,
+             uint32_t   * mask)
+{
+   uint8_t  keyBytes[8] = { 0 }, maskBytes[8] = { 0 };
+   uint32_t tailOffset = nameLen > 4 ? nameLen - 4 : 0;
+   size_t   i;
+   // The first word of an entry holds the name length, the attributes and
+   // the first two bytes of the name. Numbered names share their first
+   // bytes, so the second word is the last four bytes of the name.
+   keyBytes[0] = nameLen;
+   maskBytes[0] = 0xFF;
+   for(i = 0; i < 2 && i < nameLen; i++) {
+      keyBytes[i + 2] = name[i];
+      maskBytes[i + 2] = 0xFF;
+   }
+   for(i = 0; i < 4 && tailOffset + i < nameLen; i++) {
+      keyBytes[i + 4] = name[tailOffset + i];
+      maskBytes[i + 4] = 0xFF;
+   }
+   memcpy(key, keyBytes, sizeof(keyBytes));
+   memcpy(mask, maskBytes, sizeof(maskBytes));
+   // Offset of those bytes in the entry, past the length and attributes.
+   return tailOffset + 2;
+}
+
+__m128i
+fatx_scanHeads(fatx_directory_entry * entries,
+               uint32_t               offset)
+{
+   const char * base = (const char *) entries + offset;
+   __m128i      words0, words1, words2, words3;
+   // Load from each entry and keep the first word of each load.
+   words0 = _mm_loadu_si128((const __m128i *) base);
+   words1 = _mm_loadu_si128((const __m128i *) (base + sizeof(fatx_directory_entry)));
+   words2 = _mm_loadu_si128((const __m128i *) (base + 2 * sizeof(fatx_directory_entry)));
+   words3 = _mm_loadu_si128((const __m128i *) (base + 3 * sizeof(fatx_directory_entry)));
+   return _mm_unpacklo_epi64(_mm_unpacklo_epi32(words0, words1),
+                             _mm_unpacklo_epi32(words2, words3));
+}
+
+uint32_t
+fatx_scanValidSse2(fatx_directory_entry * entries,
+                   uint32_t               entryNo)
+{
+   const __m128i sizeMask = _mm_set1_epi32(0xFF);
+   const __m128i end = _mm_set1_epi32(0xFF);
+   const __m128i maxValid = _mm_set1_epi32(FATX_MAX_NAME_LEN + 1);
+   __m128i       sizes;
+   int           hits;
+   for(; entryNo + 4 <= DIR_ENTRIES_PER_CLUSTER; entryNo += 4) {
+      sizes = _mm_and_si128(fatx_scanHeads(entries + entryNo, 0), sizeMask);
+      hits = _mm_movemask_ps(_mm_castsi128_ps(
+                _mm_or_si128(_mm_cmplt_epi32(sizes, maxValid), _mm_cmpeq_epi32(sizes, end))));
+      if(hits)
+         return entryNo + __builtin_ctz(hits);
+   }
+   return fatx_scanValidScalar(entries, entryNo);
+}
+
+uint32_t
+fatx_scanNameSse2(fatx_directory_entry * entries,
+                  uint32_t               entryNo,
+                  const char           * name,
+                  size_t                 nameLen)
+{
+   uint32_t      key[2], mask[2];
+   __m128i       keys0, keys1, masks0, masks1, heads0, heads1, matches;
+   const __m128i sizeMask = _mm_set1_epi32(0xFF);
+   const __m128i end = _mm_set1_epi32(0xFF);
+   uint32_t      tailOffset;
+   int           hits;
+   tailOffset = fatx_scanKey(name, nameLen, key, mask);
+   keys0 = _mm_set1_epi32(key[0]);
+   keys1 = _mm_set1_epi32(key[1]);
+   masks0 = _mm_set1_epi32(mask[0]);
+   masks1 = _mm_set1_epi32(mask[1]);
+   for(; entryNo + 4 <= DIR_ENTRIES_PER_CLUSTER; entryNo += 4) {
+      heads0 = fatx_scanHeads(entries + entryNo, 0);
+      heads1 = fatx_scanHeads(entries + entryNo, tailOffset);
+      matches = _mm_and_si128(_mm_cmpeq_epi32(_mm_and_si128(heads0, masks0), keys0),
+                              _mm_cmpeq_epi32(_mm_and_si128(heads1, masks1), keys1));
+      hits = _mm_movemask_ps(_mm_castsi128_ps(
+                _mm_or_si128(matches, _mm_cmpeq_epi32(_mm_and_si128(heads0, sizeMask), end))));
+      if(hits)
+         return entryNo + __builtin_ctz(hits);
+   }
+   return fatx_scanNameScalar(entries, entryNo, name, nameLen);
+}
+
+__attribute__((target("avx2"))) uint32_t
+fatx_scanValidAvx2(fatx_directory_entry * entries,
+                   uint32_t               entryNo)
+{
+   // Entries are 16 words apart.
+   const __m256i offsets = _mm256_setr_epi32(0, 16, 32, 48, 64, 80, 96, 112);
+   const __m256i sizeMask = _mm256_set1_epi32(0xFF);
+   const __m256i end = _mm256_set1_epi32(0xFF);
+   const __m256i maxValid = _mm256_set1_epi32(FATX_MAX_NAME_LEN + 1);
+   __m256i       sizes;
+   int           hits;
+   for(; entryNo + 8 <= DIR_ENTRIES_PER_CLUSTER; entryNo += 8) {
+      sizes = _mm256_and_si256(_mm256_i32gather_epi32((const int *) (entries + entryNo),
+                                                      offsets, 4), sizeMask);
+      hits = _mm256_movemask_ps(_mm256_castsi256_ps(
+                _mm256_or_si256(_mm256_cmpgt_epi32(maxValid, sizes),
+                                _mm256_cmpeq_epi32(sizes, end))));
+      if(hits)
+         return entryNo + __builtin_ctz(hits);
+   }
+   return fatx_scanValidScalar(entries, entryNo);
+}
+
+__attribute__((target("avx2"))) uint32_t
+fatx_scanNameAvx2(fatx_directory_entry * entries,
+                  uint32_t               entryNo,
+                  const char           * name,
+                  size_t                 nameLen)
+{
+   const __m256i offsets = _mm256_setr_epi32(0, 16, 32, 48, 64, 80, 96, 112);
+   const __m256i sizeMask = _mm256_set1_epi32(0xFF);
+   const __m256i end = _mm256_set1_epi32(0xFF);
+   uint32_t      key[2], mask[2];
+   __m256i       keys0, keys1, masks0, masks1, heads0, heads1, matches;
+   const char  * base;
+   uint32_t      tailOffset;
+   int           hits;
+   tailOffset = fatx_scanKey(name, nameLen, key, mask);
+   keys0 = _mm256_set1_epi32(key[0]);
+   keys1 = _mm256_set1_epi32(key[1]);
+   masks0 = _mm256_set1_epi32(mask[0]);
+   masks1 = _mm256_set1_epi32(mask[1]);
+   for(; entryNo + 8 <= DIR_ENTRIES_PER_CLUSTER; entryNo += 8) {
+      base = (const char *) (entries + entryNo);
+      heads0 = _mm256_i32gather_epi32((const int *) base, offsets, 4);
+      heads1 = _mm256_i32gather_epi32((const int *) (base + tailOffset), offsets, 4);
+      matches = _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_and_si256(heads0, masks0), keys0),
+                                 _mm256_cmpeq_epi32(_mm256_and_si256(heads1, masks1), keys1));
+      hits = _mm256_movemask_ps(_mm256_castsi256_ps(
+                _mm256_or_si256(matches,
+                                _mm256_cmpeq_epi32(_mm256_and_si256(heads0, sizeMask), end))));
+      if(hits)
+         return entryNo + __builtin_ctz(hits);
+   }
+   return fatx_scanNameScalar(entries, entryNo, name, nameLen);
+}
+
+#endif //FATX_SCAN_X86